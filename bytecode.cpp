@@ -0,0 +1,393 @@
+#include "bytecode.hpp"
+#include "ir.hpp"
+
+BCFunc::BCFunc()
+    : ret_type{VAL_VOID}, num_args{0}, num_regs{0}, is_extern{false},
+      builtin{-1}, calls{0}, back_edges{0}, native{nullptr},
+      tier_failed{false} {}
+
+static ValueType value_type(Type *ty) {
+    switch (ty->kind) {
+    case TY_INT:
+        return VAL_INT;
+    case TY_FLOAT:
+        return VAL_FLOAT;
+    case TY_BOOL:
+        return VAL_BOOL;
+    case TY_STRING:
+        return VAL_STRING;
+    case TY_PTR:
+        return VAL_PTR;
+    default:
+        return VAL_VOID;
+    }
+}
+
+Bytecode::Bytecode(IR &ir) : func{nullptr}, num_locals{0} {
+    for (auto &i : ir.func_map) {
+        func_index[i.first] = funcs.size();
+        funcs.push_back(BCFunc());
+        funcs.back().name = i.second.name;
+        funcs.back().num_args = i.second.args.size();
+        funcs.back().is_extern = i.second.is_extern;
+        for (auto ty : i.second.arg_types) {
+            funcs.back().arg_types.push_back(value_type(ty));
+        }
+        funcs.back().ret_type = value_type(i.second.ret_type);
+    }
+    for (auto &i : ir.func_map) {
+        compile_func(i.second, funcs[func_index[i.first]]);
+    }
+}
+
+int Bytecode::home(int depth) { return num_locals + depth; }
+
+int Bytecode::emit(BCOp op, int a, int b, int c) {
+    func->code.push_back(BCInstr(op, a, b, c));
+    if (a + 1 > func->num_regs) {
+        func->num_regs = a + 1;
+    }
+    return func->code.size() - 1;
+}
+
+int Bytecode::add_const(Value val) {
+    func->consts.push_back(val);
+    return func->consts.size() - 1;
+}
+
+Value Bytecode::const_value(Obj *obj) {
+    if (obj->type == OBJ_INT) {
+        return Value::make_int(obj->number);
+    } else if (obj->type == OBJ_FLOAT) {
+        return Value::make_float(obj->float_number);
+    } else if (obj->type == OBJ_BOOL) {
+        return Value::make_bool(obj->bool_val);
+    } else if (obj->type == OBJ_STRING) {
+        Value val;
+        val.type = VAL_STRING;
+        val.str = obj;
+        return val;
+    }
+    error("invalid operand");
+    return Value();
+}
+
+// The value a fresh cell of type `ty` starts with.
+Value Bytecode::zero_value(Type *ty) {
+    Value val;
+    if (ty->kind == TY_INT) {
+        val = Value::make_int(0);
+    } else if (ty->kind == TY_FLOAT) {
+        val = Value::make_float(0);
+    } else if (ty->kind == TY_BOOL) {
+        val = Value::make_bool(false);
+    } else if (ty->kind == TY_STRING) {
+        val.type = VAL_STRING;
+        val.str = nullptr;
+    } else if (ty->kind == TY_PTR) {
+        val.type = VAL_PTR;
+        val.cell = nullptr;
+    }
+    return val;
+}
+
+// Point the jump at `at` to the next instruction to be emitted.
+void Bytecode::patch_jump(int at) {
+    func->code[at].b = func->code.size() - (at + 1);
+}
+
+void Bytecode::push_temp(int depth) { stack.push_back(home(depth)); }
+
+int Bytecode::pop_reg() {
+    int reg = stack.back();
+    stack.pop_back();
+    return reg;
+}
+
+// Move the arguments of `call` into consecutive home registers and pop them.
+// Returns the stack depth of the first argument.
+int Bytecode::compile_args(IRInstr &call) {
+    if (call.operand->type != OBJ_NAME) {
+        error("operand must be name");
+    }
+    if (func_index.find(call.operand->name) == func_index.end()) {
+        error("function not found: %s", call.operand->name.c_str());
+    }
+    int argc = call.operand->size;
+    int base = stack.size() - argc;
+    for (int i = 0; i < argc; i++) {
+        int reg = stack[base + i];
+        if (reg != home(base + i)) {
+            emit(BC_MOVE, home(base + i), reg, 0);
+        }
+    }
+    stack.resize(base);
+    return base;
+}
+
+void Bytecode::compile_branch(std::vector<IRInstr> &code, int dest) {
+    int depth = stack.size();
+    compile_code(code);
+    if ((int)stack.size() > depth) {
+        int result = stack.back();
+        if (result != dest) {
+            emit(BC_MOVE, dest, result, 0);
+        }
+    }
+    stack.resize(depth);
+}
+
+void Bytecode::compile_instr(IRInstr &instr) {
+    if (instr.type == IR_ADD || instr.type == IR_SUB || instr.type == IR_MUL ||
+        instr.type == IR_DIV || instr.type == IR_MOD || instr.type == IR_ADDF ||
+        instr.type == IR_SUBF || instr.type == IR_MULF ||
+        instr.type == IR_DIVF || instr.type == IR_MODF || instr.type == IR_EQ ||
+        instr.type == IR_NOT_EQ || instr.type == IR_GREATER ||
+        instr.type == IR_LESS || instr.type == IR_GREATER_EQ ||
+        instr.type == IR_LESS_EQ || instr.type == IR_LOGAND ||
+        instr.type == IR_LOGOR || instr.type == IR_BITAND ||
+        instr.type == IR_BITXOR || instr.type == IR_BITOR) {
+        int rhs = pop_reg();
+        int lhs = pop_reg();
+        BCOp op = BC_ADD;
+        switch (instr.type) {
+        case IR_ADD:
+            op = BC_ADD;
+            break;
+        case IR_SUB:
+            op = BC_SUB;
+            break;
+        case IR_MUL:
+            op = BC_MUL;
+            break;
+        case IR_DIV:
+            op = BC_DIV;
+            break;
+        case IR_MOD:
+            op = BC_MOD;
+            break;
+        case IR_ADDF:
+            op = BC_ADDF;
+            break;
+        case IR_SUBF:
+            op = BC_SUBF;
+            break;
+        case IR_MULF:
+            op = BC_MULF;
+            break;
+        case IR_DIVF:
+            op = BC_DIVF;
+            break;
+        case IR_MODF:
+            op = BC_MODF;
+            break;
+        case IR_EQ:
+            op = BC_EQ;
+            break;
+        case IR_NOT_EQ:
+            op = BC_NOT_EQ;
+            break;
+        case IR_GREATER:
+            op = BC_GREATER;
+            break;
+        case IR_LESS:
+            op = BC_LESS;
+            break;
+        case IR_GREATER_EQ:
+            op = BC_GREATER_EQ;
+            break;
+        case IR_LESS_EQ:
+            op = BC_LESS_EQ;
+            break;
+        case IR_LOGAND:
+            op = BC_LOGAND;
+            break;
+        case IR_LOGOR:
+            op = BC_LOGOR;
+            break;
+        case IR_BITAND:
+            op = BC_BITAND;
+            break;
+        case IR_BITXOR:
+            op = BC_BITXOR;
+            break;
+        case IR_BITOR:
+            op = BC_BITOR;
+            break;
+        default:
+            error("unknown operator in bytecode compiler");
+        }
+        int dest = home(stack.size());
+        emit(op, dest, lhs, rhs);
+        push_temp(stack.size());
+    } else if (instr.type == IR_NOT) {
+        int src = pop_reg();
+        int dest = home(stack.size());
+        emit(BC_NOT, dest, src, 0);
+        push_temp(stack.size());
+    } else if (instr.type == IR_ALLOC) {
+        int dest = home(stack.size());
+        Value init = zero_value(instr.operand->ty->ptr_to);
+        emit(BC_ALLOC, dest, add_const(init), 0);
+        push_temp(stack.size());
+    } else if (instr.type == IR_LOAD_PTR) {
+        int ptr = pop_reg();
+        int dest = home(stack.size());
+        emit(BC_LOAD_PTR, dest, ptr, 0);
+        push_temp(stack.size());
+    } else if (instr.type == IR_STORE_PTR) {
+        int rhs = pop_reg();
+        int lhs = pop_reg();
+        int dest = home(stack.size());
+        emit(BC_STORE_PTR, dest, lhs, rhs);
+        push_temp(stack.size());
+    } else if (instr.type == IR_PUSH) {
+        if (instr.operand->type == OBJ_CODE) {
+            code_stack.push_back(&instr.operand->code);
+        } else {
+            int dest = home(stack.size());
+            emit(BC_LOADK, dest, add_const(const_value(instr.operand)), 0);
+            push_temp(stack.size());
+        }
+    } else if (instr.type == IR_POP) {
+        pop_reg();
+    } else if (instr.type == IR_STORE) {
+        int src = pop_reg();
+        emit(BC_MOVE, instr.slot, src, 0);
+    } else if (instr.type == IR_LOAD) {
+        // A slot is not written again while a value loaded from it is still
+        // on the stack, so the entry can refer to the variable's register
+        // instead of copying it.
+        stack.push_back(instr.slot);
+    } else if (instr.type == IR_CALL) {
+        int base = compile_args(instr);
+        emit(BC_CALL, home(base), func_index[instr.operand->name],
+             instr.operand->size);
+        push_temp(base);
+    } else if (instr.type == IR_BR) {
+        std::vector<IRInstr> *else_code = code_stack.back();
+        code_stack.pop_back();
+        std::vector<IRInstr> *then_code = code_stack.back();
+        code_stack.pop_back();
+        int cond = pop_reg();
+        int dest = home(stack.size());
+
+        int jump_else = emit(BC_JMPF, cond, 0, 0);
+        compile_branch(*then_code, dest);
+        int jump_end = emit(BC_JMP, 0, 0, 0);
+        patch_jump(jump_else);
+        compile_branch(*else_code, dest);
+        patch_jump(jump_end);
+        push_temp(stack.size());
+    } else if (instr.type == IR_RET) {
+        emit(BC_RET, pop_reg(), 0, 0);
+    } else {
+        error("unsupported instruction in bytecode compiler");
+    }
+}
+
+void Bytecode::compile_code(std::vector<IRInstr> &code) {
+    for (auto &instr : code) {
+        compile_instr(instr);
+    }
+}
+
+// Compile the first `count` instructions of `code`, whose value is returned
+// from the function. A call in tail position reuses the current frame, and
+// an if/else in tail position returns from each branch instead of merging.
+void Bytecode::compile_tail(std::vector<IRInstr> &code, size_t count) {
+    for (size_t i = 0; i + 1 < count; i++) {
+        compile_instr(code[i]);
+    }
+
+    IRInstr &last = code[count - 1];
+    if (last.type == IR_CALL && func_index.count(last.operand->name) &&
+        !funcs[func_index[last.operand->name]].is_extern) {
+        int base = compile_args(last);
+        emit(BC_TAILCALL, home(base), func_index[last.operand->name],
+             last.operand->size);
+    } else if (last.type == IR_BR) {
+        std::vector<IRInstr> *else_code = code_stack.back();
+        code_stack.pop_back();
+        std::vector<IRInstr> *then_code = code_stack.back();
+        code_stack.pop_back();
+        int cond = pop_reg();
+        int depth = stack.size();
+
+        int jump_else = emit(BC_JMPF, cond, 0, 0);
+        compile_tail(*then_code, then_code->size());
+        stack.resize(depth);
+        patch_jump(jump_else);
+        compile_tail(*else_code, else_code->size());
+        stack.resize(depth);
+    } else {
+        compile_instr(last);
+        emit(BC_RET, pop_reg(), 0, 0);
+    }
+}
+
+void Bytecode::compile_func(IRFunc &ir_func, BCFunc &bc_func) {
+    if (bc_func.is_extern) {
+        return;
+    }
+
+    func = &bc_func;
+    stack.clear();
+    code_stack.clear();
+    num_locals = ir_func.num_slots;
+    bc_func.num_regs = num_locals;
+
+    std::vector<IRInstr> &code = ir_func.code;
+    if (!code.empty() && code.back().type == IR_RET) {
+        compile_tail(code, code.size() - 1);
+    } else {
+        compile_code(code);
+    }
+    func = nullptr;
+}
+
+void BCInstr::print_instr() {
+    static const char *names[] = {
+        "MOVE",     "LOADK",   "ADD",        "SUB",     "MUL",    "DIV",
+        "MOD",      "ADDF",    "SUBF",       "MULF",    "DIVF",   "MODF",
+        "EQ",       "NOT_EQ",  "GREATER",    "LESS",    "GREATER_EQ",
+        "LESS_EQ",  "LOGAND",  "LOGOR",      "BITAND",  "BITXOR", "BITOR",
+        "NOT",      "ALLOC",   "LOAD_PTR",   "STORE_PTR", "JMP",
+        "JMPF",     "CALL",    "TAILCALL",   "RET",
+    };
+    std::cout << names[op] << " " << a << " " << b << " " << c;
+}
+
+void Value::print_value() {
+    if (type == VAL_INT) {
+        std::cout << number;
+    } else if (type == VAL_FLOAT) {
+        std::cout << float_number;
+    } else if (type == VAL_BOOL) {
+        std::cout << (bool_val ? "true" : "false");
+    } else if (type == VAL_STRING) {
+        std::cout << "\"" << str->str << "\"";
+    } else if (type == VAL_PTR) {
+        std::cout << "ptr: " << cell;
+    } else {
+        std::cout << "void";
+    }
+}
+
+void BCFunc::print_func() {
+    std::cout << name << " (args: " << num_args << ", regs: " << num_regs
+              << "):" << std::endl;
+    for (auto instr : code) {
+        std::cout << "  ";
+        instr.print_instr();
+        std::cout << std::endl;
+    }
+}
+
+void Bytecode::print_bytecode() {
+    for (auto &f : funcs) {
+        if (!f.is_extern) {
+            f.print_func();
+        }
+    }
+}
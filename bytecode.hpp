@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "error.hpp"
+#include "ir.hpp"
+
+typedef enum ValueType {
+    VAL_VOID,
+    VAL_INT,
+    VAL_FLOAT,
+    VAL_BOOL,
+    VAL_STRING,
+    VAL_PTR,
+} ValueType;
+
+typedef struct VMCell VMCell;
+
+// A VM register or constant. Ints, floats and bools are stored unboxed;
+// only strings and pointers refer to heap objects.
+struct Value {
+    ValueType type;
+    union {
+        int number;
+        double float_number;
+        bool bool_val;
+        Obj *str;
+        VMCell *cell;
+    };
+
+    Value() : type{VAL_VOID}, float_number{0} {};
+    static Value make_int(int number) {
+        Value val;
+        val.type = VAL_INT;
+        val.number = number;
+        return val;
+    }
+    static Value make_float(double float_number) {
+        Value val;
+        val.type = VAL_FLOAT;
+        val.float_number = float_number;
+        return val;
+    }
+    static Value make_bool(bool bool_val) {
+        Value val;
+        val.type = VAL_BOOL;
+        val.bool_val = bool_val;
+        return val;
+    }
+    void print_value();
+};
+
+static_assert(sizeof(Value) == 16, "Value must stay two words");
+
+// The target of a VM pointer, i.e. the result of `new`.
+struct VMCell {
+    Value value;
+    bool marked;
+};
+
+// Register-based bytecode executed by the VM. Every function is compiled
+// into one contiguous instruction array; branches are relative jumps and
+// operands are register slots of the current frame.
+typedef enum BCOp {
+    BC_MOVE,      // R[a] = R[b]
+    BC_LOADK,     // R[a] = K[b]
+    BC_ADD,       // R[a] = R[b] op R[c]
+    BC_SUB,
+    BC_MUL,
+    BC_DIV,
+    BC_MOD,
+    BC_ADDF,
+    BC_SUBF,
+    BC_MULF,
+    BC_DIVF,
+    BC_MODF,
+    BC_EQ,
+    BC_NOT_EQ,
+    BC_GREATER,
+    BC_LESS,
+    BC_GREATER_EQ,
+    BC_LESS_EQ,
+    BC_LOGAND,
+    BC_LOGOR,
+    BC_BITAND,
+    BC_BITXOR,
+    BC_BITOR,
+    BC_NOT,       // R[a] = not R[b]
+    BC_ALLOC,     // R[a] = new cell initialized with K[b]
+    BC_LOAD_PTR,  // R[a] = *R[b]
+    BC_STORE_PTR, // *R[b] = R[c]; R[a] = R[c]
+    BC_JMP,       // pc += b
+    BC_JMPF,      // if not R[a] then pc += b
+    BC_CALL,      // R[a] = funcs[b](R[a], ..., R[a + c - 1])
+    BC_TAILCALL,  // return funcs[b](R[a], ..., R[a + c - 1]) in this frame
+    BC_RET,       // return R[a]
+} BCOp;
+
+struct BCInstr {
+    BCOp op;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+
+    BCInstr(BCOp op, int32_t a, int32_t b, int32_t c)
+        : op{op}, a{a}, b{b}, c{c} {};
+    void print_instr();
+};
+
+// Entry point of a function promoted to native code. Arguments and the
+// result are passed as raw 64-bit words: ints sign-extended, bools as 0/1
+// and floats by their bit pattern.
+typedef int64_t (*NativeEntry)(int64_t *args);
+
+class BCFunc {
+  public:
+    std::vector<BCInstr> code;
+    std::vector<Value> consts;
+    std::string name;
+    std::vector<ValueType> arg_types;
+    ValueType ret_type;
+    int num_args;
+    int num_regs;
+    bool is_extern;
+    // Builtin implementing an extern function, bound by VM::link.
+    int builtin;
+    // Profile used by the VM to decide when to tier the function up.
+    int calls;
+    int back_edges;
+    // Native code for the function once tiered up, or nullptr.
+    NativeEntry native;
+    // Set when the function cannot be compiled so it is not retried.
+    bool tier_failed;
+
+    BCFunc();
+    void print_func();
+};
+
+class Bytecode {
+  private:
+    // Per-function compilation state. The IR is a stack machine; the
+    // compiler tracks which register holds each IR stack entry. Variables
+    // live in the registers of their IR slots; an entry at depth i either
+    // lives in its home register (num_locals + i) or refers directly to a
+    // variable's register.
+    BCFunc *func;
+    std::vector<int> stack;
+    std::vector<std::vector<IRInstr> *> code_stack;
+    int num_locals;
+
+    int home(int depth);
+    int emit(BCOp op, int a, int b, int c);
+    int add_const(Value val);
+    Value const_value(Obj *obj);
+    Value zero_value(Type *ty);
+    void patch_jump(int at);
+    void push_temp(int depth);
+    int pop_reg();
+    int compile_args(IRInstr &call);
+    void compile_branch(std::vector<IRInstr> &code, int dest);
+    void compile_instr(IRInstr &instr);
+    void compile_code(std::vector<IRInstr> &code);
+    void compile_tail(std::vector<IRInstr> &code, size_t count);
+    void compile_func(IRFunc &ir_func, BCFunc &bc_func);
+
+  public:
+    std::vector<BCFunc> funcs;
+    std::map<std::string, int> func_index;
+
+    Bytecode(IR &ir);
+    void print_bytecode();
+};
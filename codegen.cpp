@@ -2,19 +2,47 @@
 #include "error.hpp"
 #include "ir.hpp"
 #include "parser.hpp"
+#include "runtime/cpu.hpp"
+#include "runtime/gc.hpp"
 
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <algorithm>
 #include <atomic>
 #include <cstdio>
 #include <memory>
 #include <ostream>
+#include <sstream>
 #include <system_error>
 
-Codegen::Codegen(IR ir) : builder(context), ir{ir} {
+// Register the host target and the builtin GC strategies the first time
+// code is generated. Only the native target is needed: otus always
+// compiles for the machine it runs on.
+static void init_llvm() {
+    static bool initialized = false;
+    if (initialized) {
+        return;
+    }
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmParser();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::linkAllBuiltinGCs();
+    initialized = true;
+}
+
+Codegen::Codegen(IR &ir, GCBackend gc_backend)
+    : owned_context{std::make_unique<llvm::LLVMContext>()},
+      context(*owned_context), builder(context), ir(ir),
+      gc_backend{gc_backend}, has_gc_roots{false}, has_statepoints{false},
+      loop_header{nullptr} {
+    init_llvm();
     module = std::make_unique<llvm::Module>("jit", context);
 }
 
 // Generate LLVM IR Code from IR Code.
-void Codegen::gen_instr(IRInstr instr, CodegenEnv *e) {
+void Codegen::gen_instr(const IRInstr &instr) {
     if (instr.type == IR_ADD || instr.type == IR_SUB || instr.type == IR_MUL ||
         instr.type == IR_DIV || instr.type == IR_MOD || instr.type == IR_ADDF ||
         instr.type == IR_SUBF || instr.type == IR_MULF ||
@@ -111,7 +139,7 @@ void Codegen::gen_instr(IRInstr instr, CodegenEnv *e) {
         stack.push(builder.CreateNeg(val, "negtmp"));
     } else if (instr.type == IR_PUSH) {
         if (instr.operand->type == OBJ_CODE) {
-            code_stack.push(instr.operand->code);
+            code_stack.push(&instr.operand->code);
         } else if (instr.operand->type == OBJ_INT) {
             stack.push(llvm::ConstantInt::get(
                 context, llvm::APInt(32, instr.operand->number, true)));
@@ -130,33 +158,28 @@ void Codegen::gen_instr(IRInstr instr, CodegenEnv *e) {
     } else if (instr.type == IR_POP) {
         stack.pop();
     } else if (instr.type == IR_STORE) {
-        if (instr.operand->type != OBJ_NAME) {
-            error("operand must be name");
+        if (instr.slot < 0) {
+            error("unresolved variable: %s", instr.operand->name.c_str());
         }
 
-        std::string name = instr.operand->name;
-
         llvm::Value *val = stack.top();
         stack.pop();
-        e->set(name, val);
+        slots[instr.slot] = val;
     } else if (instr.type == IR_LOAD) {
-        if (instr.operand->type != OBJ_NAME) {
-            error("operand must be name");
+        if (instr.slot < 0) {
+            error("unresolved variable: %s", instr.operand->name.c_str());
         }
 
-        std::string name = instr.operand->name;
-        llvm::Value *val;
-        if ((val = e->get(name)) == NULL) {
-            error("undeclared variable: %s", name.c_str());
-        }
-
-        stack.push(val);
+        stack.push(slots[instr.slot]);
     } else if (instr.type == IR_STORE_PTR) {
         llvm::Value *rhs = stack.top();
         stack.pop();
         llvm::Value *lhs = stack.top();
         stack.pop();
 
+        if (is_gc_pointer(rhs->getType())) {
+            gen_write_barrier(lhs, rhs);
+        }
         builder.CreateStore(rhs, lhs);
         // llvm::Value *val = builder.CreateGEP(lhs, 0);
         stack.push(rhs);
@@ -165,70 +188,32 @@ void Codegen::gen_instr(IRInstr instr, CodegenEnv *e) {
         stack.pop();
 
         llvm::Value *val = builder.CreateLoad(ptr);
-        stack.push(val);
+        stack.push(root_value(val));
     } else if (instr.type == IR_ALLOC) {
         llvm::Type *orig_type =
             convert_type_to_llvm_type(instr.operand->ty->ptr_to);
-        llvm::Function *alloc = module->getFunction("alloc");
-        std::vector<llvm::Value *> alloc_arg;
-        llvm::Value *ptr_size =
-            llvm::ConstantInt::get(llvm::Type::getInt64Ty(context),
-                                   orig_type->getPrimitiveSizeInBits() / 8);
-        alloc_arg.push_back(ptr_size);
-        llvm::Value *pp =
-            builder.CreateAlloca(convert_type_to_llvm_type(instr.operand->ty));
-        llvm::Value *val = builder.CreateCall(alloc, alloc_arg);
-        llvm::Value *casted_pp = builder.CreateBitCast(
-            pp, llvm::PointerType::getUnqual(val->getType()));
-        builder.CreateStore(val, casted_pp);
-        llvm::Function *callee = module->getFunction("llvm.gcroot");
-        std::vector<llvm::Value *> argv;
-        argv.push_back(casted_pp);
-        argv.push_back(
-            llvm::ConstantPointerNull::get(llvm::Type::getInt8PtrTy(context)));
-        builder.CreateCall(callee, argv);
+        llvm::Value *val = gen_alloc(orig_type);
+        reload_roots();
         llvm::Value *res = builder.CreateBitCast(
             val, convert_type_to_llvm_type(instr.operand->ty));
-        stack.push(res);
+        stack.push(root_value(res));
     } else if (instr.type == IR_CALL) {
-        if (instr.operand->type != OBJ_NAME) {
-            error("operand must be name");
-        }
-
-        std::string name;
-        if (ir.func_map[instr.operand->name].is_extern) {
-            // name.push_back('_');
-        }
-        name.append(instr.operand->name);
-        llvm::Function *callee = module->getFunction(name);
-        if (!callee) {
-            // There's nothing to do.
-        }
-        if (callee->arg_size() != instr.operand->size) {
-            error("incorrect arguments passed");
-        }
-        CodegenEnv *new_env = new CodegenEnv(e);
-        std::vector<llvm::Value *> argv;
-        for (int i = 0; i < callee->arg_size(); i++) {
-            argv.push_back(stack.top());
-            stack.pop();
-        }
-
-        if (callee->getReturnType()->isVoidTy()) {
-            builder.CreateCall(callee, argv);
-            stack.push(nullptr);
-        } else {
-            stack.push(builder.CreateCall(callee, argv, "calltmp"));
-            std::cout << name << std::endl;
-            std::flush(std::cout);
+        llvm::Value *call = gen_call(instr);
+        if (ir.func_map[instr.operand->name].may_collect) {
+            reload_roots();
         }
+        stack.push(root_value(call));
     } else if (instr.type == IR_BR) {
-        std::vector<IRInstr> else_code = code_stack.top();
+        const std::vector<IRInstr> &else_code = *code_stack.top();
         code_stack.pop();
-        std::vector<IRInstr> then_code = code_stack.top();
+        const std::vector<IRInstr> &then_code = *code_stack.top();
         code_stack.pop();
         llvm::Value *cond = stack.top();
         stack.pop();
+        // Each branch starts from the values before the if; the values a
+        // branch reloads after a call do not dominate the other one.
+        std::stack<llvm::Value *> saved_stack = stack;
+        std::vector<llvm::Value *> saved_slots = slots;
 
         llvm::Function *function = builder.GetInsertBlock()->getParent();
         llvm::BasicBlock *then_bb =
@@ -239,24 +224,26 @@ void Codegen::gen_instr(IRInstr instr, CodegenEnv *e) {
         builder.CreateCondBr(cond, then_bb, else_bb);
 
         builder.SetInsertPoint(then_bb);
-        CodegenEnv *then_env = new CodegenEnv(e);
-        gen_code(then_code, then_env);
+        gen_code(then_code);
         llvm::Value *then_v = stack.top();
-        stack.pop();
         builder.CreateBr(merge_bb);
         then_bb = builder.GetInsertBlock();
+        stack = saved_stack;
+        slots = saved_slots;
 
         function->getBasicBlockList().push_back(else_bb);
         builder.SetInsertPoint(else_bb);
-        CodegenEnv *else_env = new CodegenEnv(e);
-        gen_code(else_code, else_env);
+        gen_code(else_code);
         llvm::Value *else_v = stack.top();
-        stack.pop();
         builder.CreateBr(merge_bb);
         else_bb = builder.GetInsertBlock();
+        stack = saved_stack;
+        slots = saved_slots;
 
         function->getBasicBlockList().push_back(merge_bb);
         builder.SetInsertPoint(merge_bb);
+        // Either branch may have moved objects.
+        reload_roots();
         if (then_v == nullptr || else_v == nullptr) {
             stack.push(nullptr);
             return;
@@ -264,7 +251,7 @@ void Codegen::gen_instr(IRInstr instr, CodegenEnv *e) {
         llvm::PHINode *PN = builder.CreatePHI(then_v->getType(), 2, "iftmp");
         PN->addIncoming(then_v, then_bb);
         PN->addIncoming(else_v, else_bb);
-        stack.push(PN);
+        stack.push(root_value(PN));
     } else if (instr.type == IR_RET) {
         llvm::Value *val = stack.top();
         stack.pop();
@@ -305,7 +292,441 @@ llvm::Type *Codegen::convert_type_to_llvm_type(Type *ty) {
     }
 }
 
-void Codegen::gen_function(IRFunc func) {
+// Call the function named by `instr`, returning its result or nullptr if
+// it returns void. A call in `tail` position may become a jump.
+llvm::Value *Codegen::gen_call(const IRInstr &instr, bool tail) {
+    if (instr.operand->type != OBJ_NAME) {
+        error("operand must be name");
+    }
+
+    std::string name;
+    if (ir.func_map[instr.operand->name].is_extern) {
+        // name.push_back('_');
+    }
+    name.append(instr.operand->name);
+    llvm::Function *callee = module->getFunction(name);
+    if (!callee) {
+        error("function not found: %s", name.c_str());
+    }
+    if (callee->arg_size() != instr.operand->size) {
+        error("incorrect arguments passed");
+    }
+    // The last argument is on top of the stack.
+    std::vector<llvm::Value *> argv(callee->arg_size());
+    for (int i = callee->arg_size() - 1; i >= 0; i--) {
+        argv[i] = stack.top();
+        stack.pop();
+    }
+
+    // A shadow-stack frame holding gcroots is popped after the call
+    // returns, so such functions keep ordinary calls. Statepoint frames
+    // need no epilogue, but a call that returns to the frame and may
+    // collect must be a statepoint, so only guaranteed tail calls are left
+    // plain.
+    llvm::Function *caller = builder.GetInsertBlock()->getParent();
+    bool is_void = callee->getReturnType()->isVoidTy();
+    bool jump = callee->getFunctionType() == caller->getFunctionType() &&
+                callee->getCallingConv() == caller->getCallingConv();
+    tail = tail && (gc_backend == GC_STATEPOINT ? jump : !has_gc_roots);
+    if (!tail && ir.func_map[instr.operand->name].may_collect) {
+        return gen_safepoint_call(callee, argv);
+    }
+    llvm::CallInst *call =
+        builder.CreateCall(callee, argv, is_void ? "" : "calltmp");
+    call->setCallingConv(callee->getCallingConv());
+    if (tail && jump) {
+        call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    } else if (tail) {
+        call->setTailCall();
+    }
+    return is_void ? nullptr : call;
+}
+
+// Call `callee`, which may collect. With the statepoint backend the call
+// carries the root slots of the values still in use, and insert_statepoints
+// turns it into a statepoint listing them; the collector updates the slots
+// in place and reload_roots reads them back.
+llvm::Value *Codegen::gen_safepoint_call(llvm::Function *callee,
+                                         llvm::ArrayRef<llvm::Value *> args) {
+    bool is_void = callee->getReturnType()->isVoidTy();
+    std::vector<llvm::OperandBundleDef> bundles;
+    if (gc_backend == GC_STATEPOINT) {
+        std::vector<llvm::AllocaInst *> live_slots = live_root_slots();
+        std::vector<llvm::Value *> live(live_slots.begin(), live_slots.end());
+        bundles.emplace_back(ROOTS_BUNDLE, live);
+        has_statepoints = true;
+    }
+    llvm::CallInst *call =
+        builder.CreateCall(callee, args, bundles, is_void ? "" : "calltmp");
+    call->setCallingConv(callee->getCallingConv());
+    return is_void ? nullptr : call;
+}
+
+// Replace the calls gen_safepoint_call gave root slots with statepoints.
+// This runs after the optimizer. It leaves calls with an unknown bundle
+// alone and assumes they may write the slots, but it would drop the slots
+// from the live set of a statepoint, since nothing relocates them.
+void Codegen::insert_statepoints() {
+    for (llvm::Function &function : *module) {
+        std::vector<llvm::CallInst *> calls;
+        for (llvm::BasicBlock &bb : function) {
+            for (llvm::Instruction &inst : bb) {
+                auto call = llvm::dyn_cast<llvm::CallInst>(&inst);
+                if (call && call->getOperandBundle(ROOTS_BUNDLE)) {
+                    calls.push_back(call);
+                }
+            }
+        }
+        for (auto call : calls) {
+            builder.SetInsertPoint(call);
+            llvm::OperandBundleUse roots =
+                *call->getOperandBundle(ROOTS_BUNDLE);
+            std::vector<llvm::Value *> args(call->arg_begin(), call->arg_end());
+            std::vector<llvm::Value *> live(roots.Inputs.begin(),
+                                            roots.Inputs.end());
+            llvm::CallInst *statepoint = builder.CreateGCStatepointCall(
+                0, 0, call->getCalledFunction(), args, {}, live);
+            statepoint->setCallingConv(call->getCallingConv());
+            if (!call->getType()->isVoidTy()) {
+                call->replaceAllUsesWith(builder.CreateGCResult(
+                    statepoint, call->getType(), "calltmp"));
+            }
+            call->eraseFromParent();
+        }
+    }
+}
+
+// Whether `code` creates heap pointers, by allocating or by calling a
+// function that returns one.
+static bool uses_gc_pointers(IR &ir, const std::vector<IRInstr> &code) {
+    for (auto &instr : code) {
+        if (instr.type == IR_ALLOC) {
+            return true;
+        } else if (instr.type == IR_CALL) {
+            auto callee = ir.func_map.find(instr.operand->name);
+            if (callee != ir.func_map.end() &&
+                callee->second.ret_type->kind == TY_PTR) {
+                return true;
+            }
+        } else if (instr.type == IR_PUSH && instr.operand->type == OBJ_CODE &&
+                   uses_gc_pointers(ir, instr.operand->code)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether `code` calls the function `name`, which is how otus programs
+// loop.
+static bool calls_itself(const std::string &name,
+                         const std::vector<IRInstr> &code) {
+    for (auto &instr : code) {
+        if (instr.type == IR_CALL && instr.operand->name == name) {
+            return true;
+        } else if (instr.type == IR_PUSH && instr.operand->type == OBJ_CODE &&
+                   calls_itself(name, instr.operand->code)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Heap pointers are the pointer types other than strings, which point to
+// constant data.
+bool Codegen::is_gc_pointer(llvm::Type *ty) {
+    return ty->isPointerTy() && ty != llvm::Type::getInt8PtrTy(context);
+}
+
+// Give the heap pointer `val` a root slot in the entry block and store it
+// there. Other values, and any value in a function that cannot collect,
+// are returned unchanged. With the shadow stack the slot is a gcroot;
+// statepoints pass their live slots explicitly.
+llvm::Value *Codegen::root_value(llvm::Value *val) {
+    if (!has_gc_roots || val == nullptr || !is_gc_pointer(val->getType())) {
+        return val;
+    }
+    llvm::AllocaInst *slot = root_slot(val->getType());
+    builder.CreateStore(val, slot);
+    roots[val] = slot;
+    return val;
+}
+
+// The slots of the values in the variables and on the stack, in order of
+// first use.
+std::vector<llvm::AllocaInst *> Codegen::live_root_slots() {
+    std::vector<llvm::AllocaInst *> live;
+    auto add = [&](llvm::Value *val) {
+        auto it = roots.find(val);
+        if (it != roots.end() &&
+            std::find(live.begin(), live.end(), it->second) == live.end()) {
+            live.push_back(it->second);
+        }
+    };
+    for (auto val : slots) {
+        add(val);
+    }
+    for (std::stack<llvm::Value *> rest = stack; !rest.empty(); rest.pop()) {
+        add(rest.top());
+    }
+    return live;
+}
+
+// A root slot for a value of type `ty`: a free slot of that type if there
+// is one, or else a new one in the entry block. Values live on different
+// branches of an if can share a slot, since only one branch runs.
+llvm::AllocaInst *Codegen::root_slot(llvm::Type *ty) {
+    std::vector<llvm::AllocaInst *> live = live_root_slots();
+    for (auto slot : root_slots) {
+        if (slot->getAllocatedType() == ty &&
+            std::find(live.begin(), live.end(), slot) == live.end()) {
+            return slot;
+        }
+    }
+    llvm::BasicBlock &entry =
+        builder.GetInsertBlock()->getParent()->getEntryBlock();
+    llvm::IRBuilder<> at_entry(&entry, entry.begin());
+    llvm::AllocaInst *slot = at_entry.CreateAlloca(ty);
+    if (gc_backend == GC_SHADOW_STACK) {
+        llvm::Type *i8_ptr = llvm::Type::getInt8PtrTy(context);
+        llvm::Value *root = at_entry.CreateBitCast(
+            slot, llvm::PointerType::getUnqual(i8_ptr));
+        // The collector learns the type of the objects a root points to
+        // from its metadata.
+        llvm::Constant *type = llvm::ConstantExpr::getBitCast(
+            type_descriptor(ty->getPointerElementType()), i8_ptr);
+        at_entry.CreateCall(module->getFunction("llvm.gcroot"),
+                            {root, type});
+    }
+    // The collector may scan the slot before the value is stored.
+    at_entry.CreateStore(
+        llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(ty)),
+        slot);
+    root_slots.push_back(slot);
+    return slot;
+}
+
+llvm::Value *Codegen::reload(llvm::Value *val) {
+    auto it = roots.find(val);
+    if (it == roots.end()) {
+        return val;
+    }
+    llvm::AllocaInst *slot = it->second;
+    llvm::Value *fresh = builder.CreateLoad(slot->getAllocatedType(), slot);
+    roots[fresh] = slot;
+    return fresh;
+}
+
+// Replace every rooted value in the variables and on the stack with a load
+// from its slot, after a call that may have moved objects.
+void Codegen::reload_roots() {
+    if (roots.empty()) {
+        return;
+    }
+    for (auto &val : slots) {
+        val = reload(val);
+    }
+    std::stack<llvm::Value *> reloaded;
+    while (!stack.empty()) {
+        reloaded.push(reload(stack.top()));
+        stack.pop();
+    }
+    while (!reloaded.empty()) {
+        stack.push(reloaded.top());
+        reloaded.pop();
+    }
+}
+
+// Allocate an object of type `ty`. Objects that fit in the nursery are bump
+// allocated inline; the runtime is only called when the current nursery
+// page is full.
+llvm::Value *Codegen::gen_alloc(llvm::Type *ty) {
+    uint64_t size = module->getDataLayout().getTypeAllocSize(ty);
+    llvm::Function *alloc = module->getFunction("alloc_typed");
+    llvm::GlobalVariable *type = type_descriptor(ty);
+    if (size > GC_NURSERY_MAX_OBJECT) {
+        return gen_safepoint_call(alloc, {type});
+    }
+    uint64_t total = GC_HEADER_SIZE + ((size + 7) & ~(uint64_t)7);
+
+    llvm::Type *i8 = builder.getInt8Ty();
+    llvm::Type *i8_ptr = builder.getInt8PtrTy();
+    llvm::GlobalVariable *nursery = module->getGlobalVariable("otus_nursery");
+    llvm::Type *nursery_type = nursery->getValueType();
+    llvm::Value *cursor_p = builder.CreateStructGEP(nursery_type, nursery, 0);
+    llvm::Value *limit_p = builder.CreateStructGEP(nursery_type, nursery, 1);
+    llvm::Value *cursor = builder.CreateLoad(i8_ptr, cursor_p);
+    llvm::Value *limit = builder.CreateLoad(i8_ptr, limit_p);
+    llvm::Value *next =
+        builder.CreateGEP(i8, cursor, builder.getInt64(total), "next");
+    llvm::Value *fits = builder.CreateICmpULE(next, limit);
+
+    llvm::Function *function = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *fast_bb =
+        llvm::BasicBlock::Create(context, "alloc.fast", function);
+    llvm::BasicBlock *slow_bb =
+        llvm::BasicBlock::Create(context, "alloc.slow", function);
+    llvm::BasicBlock *done_bb =
+        llvm::BasicBlock::Create(context, "alloc.done", function);
+    llvm::MDBuilder md(context);
+    builder.CreateCondBr(fits, fast_bb, slow_bb,
+                         md.createBranchWeights(2000, 1));
+
+    builder.SetInsertPoint(fast_bb);
+    builder.CreateStore(next, cursor_p);
+    llvm::Value *header_p = builder.CreateBitCast(
+        cursor, llvm::PointerType::getUnqual(builder.getInt64Ty()));
+    builder.CreateStore(builder.CreatePtrToInt(type, builder.getInt64Ty()),
+                        header_p);
+    llvm::Value *fast_obj = builder.CreateGEP(
+        i8, cursor, builder.getInt64(GC_HEADER_SIZE), "obj");
+    builder.CreateBr(done_bb);
+
+    builder.SetInsertPoint(slow_bb);
+    llvm::Value *slow_obj = gen_safepoint_call(alloc, {type});
+    builder.CreateBr(done_bb);
+
+    builder.SetInsertPoint(done_bb);
+    llvm::PHINode *obj = builder.CreatePHI(i8_ptr, 2);
+    obj->addIncoming(fast_obj, fast_bb);
+    obj->addIncoming(slow_obj, slow_bb);
+    return obj;
+}
+
+// The TypeDescriptor of objects of type `ty` (see runtime/gc.hpp). Only
+// the first 64 words of an object can be described as pointers.
+llvm::GlobalVariable *Codegen::type_descriptor(llvm::Type *ty) {
+    auto it = descriptors.find(ty);
+    if (it != descriptors.end()) {
+        return it->second;
+    }
+    const llvm::DataLayout &layout = module->getDataLayout();
+    uint64_t pointers = 0;
+    if (auto *struct_ty = llvm::dyn_cast<llvm::StructType>(ty)) {
+        const llvm::StructLayout *fields = layout.getStructLayout(struct_ty);
+        for (unsigned i = 0; i < struct_ty->getNumElements(); i++) {
+            uint64_t word = fields->getElementOffset(i) / sizeof(void *);
+            if (is_gc_pointer(struct_ty->getElementType(i)) && word < 64) {
+                pointers |= (uint64_t)1 << word;
+            }
+        }
+    } else if (is_gc_pointer(ty)) {
+        pointers = 1;
+    }
+    llvm::Constant *init = llvm::ConstantStruct::get(
+        descriptor_type, {builder.getInt64(layout.getTypeAllocSize(ty)),
+                          builder.getInt64(pointers)});
+    llvm::GlobalVariable *type = new llvm::GlobalVariable(
+        *module, descriptor_type, true, llvm::GlobalValue::PrivateLinkage,
+        init, "otus.type");
+    // The collector tags header words in their low bit.
+    type->setAlignment(llvm::MaybeAlign(8));
+    descriptors[ty] = type;
+    return type;
+}
+
+// Barriers for storing the heap pointer `val` into `obj` (see
+// runtime/gc.hpp): dirty the card of `obj`, and shade `val` while an
+// incremental collection is marking.
+void Codegen::gen_write_barrier(llvm::Value *obj, llvm::Value *val) {
+    llvm::Type *i64 = builder.getInt64Ty();
+    llvm::Value *addr = builder.CreatePtrToInt(obj, i64);
+    llvm::Value *page = builder.CreateAnd(addr, ~(uint64_t)(GC_PAGE_SIZE - 1));
+    llvm::Value *card = builder.CreateLShr(
+        builder.CreateAnd(addr, GC_PAGE_SIZE - 1), GC_CARD_SHIFT);
+    llvm::Value *cards =
+        builder.CreateAdd(page, builder.getInt64(offsetof(PageHeader, cards)));
+    llvm::Value *at = builder.CreateIntToPtr(builder.CreateAdd(cards, card),
+                                             builder.getInt8PtrTy());
+    builder.CreateStore(builder.getInt8(1), at);
+
+    llvm::Value *marking = builder.CreateLoad(
+        builder.getInt8Ty(), module->getGlobalVariable("otus_gc_marking"));
+    llvm::Function *function = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *shade_bb =
+        llvm::BasicBlock::Create(context, "shade", function);
+    llvm::BasicBlock *cont_bb =
+        llvm::BasicBlock::Create(context, "shade.cont", function);
+    llvm::MDBuilder md(context);
+    builder.CreateCondBr(builder.CreateICmpNE(marking, builder.getInt8(0)),
+                         shade_bb, cont_bb, md.createBranchWeights(1, 2000));
+    builder.SetInsertPoint(shade_bb);
+    builder.CreateCall(module->getFunction("otus_gc_shade"),
+                       {builder.CreateBitCast(val, builder.getInt8PtrTy())});
+    builder.CreateBr(cont_bb);
+    builder.SetInsertPoint(cont_bb);
+}
+
+// Generate the first `count` instructions of `code`, whose value is returned
+// from the current function. Calls in tail position are marked, or branch
+// back to the loop header, so that self-recursive loops run in constant
+// stack, and an if/else in tail position returns from each branch instead
+// of merging into a phi.
+void Codegen::gen_tail_code(const std::vector<IRInstr> &code, size_t count) {
+    for (size_t i = 0; i + 1 < count; i++) {
+        gen_instr(code[i]);
+    }
+
+    const IRInstr &last = code[count - 1];
+    if (last.type == IR_CALL && loop_header != nullptr &&
+        module->getFunction(last.operand->name) ==
+            builder.GetInsertBlock()->getParent()) {
+        gen_loop_back();
+    } else if (last.type == IR_CALL) {
+        llvm::Value *call = gen_call(last, true);
+        if (call == nullptr) {
+            builder.CreateRetVoid();
+        } else {
+            builder.CreateRet(call);
+        }
+    } else if (last.type == IR_BR) {
+        const std::vector<IRInstr> &else_code = *code_stack.top();
+        code_stack.pop();
+        const std::vector<IRInstr> &then_code = *code_stack.top();
+        code_stack.pop();
+        llvm::Value *cond = stack.top();
+        stack.pop();
+        std::stack<llvm::Value *> saved_stack = stack;
+        std::vector<llvm::Value *> saved_slots = slots;
+
+        llvm::Function *function = builder.GetInsertBlock()->getParent();
+        llvm::BasicBlock *then_bb =
+            llvm::BasicBlock::Create(context, "then", function);
+        llvm::BasicBlock *else_bb =
+            llvm::BasicBlock::Create(context, "else", function);
+        builder.CreateCondBr(cond, then_bb, else_bb);
+
+        builder.SetInsertPoint(then_bb);
+        gen_tail_code(then_code, then_code.size());
+        stack = saved_stack;
+        slots = saved_slots;
+
+        builder.SetInsertPoint(else_bb);
+        gen_tail_code(else_code, else_code.size());
+        stack = saved_stack;
+        slots = saved_slots;
+    } else {
+        gen_instr(last);
+        llvm::Value *val = stack.top();
+        stack.pop();
+        builder.CreateRet(val);
+    }
+}
+
+// Loop back to the header of the current function with the arguments of
+// the self call on the stack.
+void Codegen::gen_loop_back() {
+    std::vector<llvm::Value *> argv(loop_args.size());
+    for (int i = loop_args.size() - 1; i >= 0; i--) {
+        argv[i] = stack.top();
+        stack.pop();
+    }
+    for (size_t i = 0; i < argv.size(); i++) {
+        loop_args[i]->addIncoming(argv[i], builder.GetInsertBlock());
+    }
+    builder.CreateBr(loop_header);
+}
+
+void Codegen::gen_function(const IRFunc &func) {
     // std::vector<llvm::Type *> arg_types(func.args.size(),
     //                                     llvm::Type::getInt32Ty(context));
     // llvm::FunctionType *ft = llvm::FunctionType::get(
@@ -316,23 +737,66 @@ void Codegen::gen_function(IRFunc func) {
         return;
     }
     llvm::Function *f = module->getFunction(func.name);
-    f->setGC("shadow-stack");
+    // Only functions that may collect need roots. Statepoints are needed
+    // even without roots, so that the collector can walk past the frame.
+    has_gc_roots = false;
+    if (func.may_collect) {
+        has_gc_roots = uses_gc_pointers(ir, func.code);
+        for (auto &arg : f->args()) {
+            has_gc_roots = has_gc_roots || is_gc_pointer(arg.getType());
+        }
+    }
+    if (gc_backend == GC_STATEPOINT && func.may_collect) {
+        // The collector walks the frames by their frame pointers.
+        f->setGC("statepoint-example");
+        f->addFnAttr("frame-pointer", "all");
+    } else if (gc_backend == GC_SHADOW_STACK && has_gc_roots) {
+        f->setGC("shadow-stack");
+    }
 
     llvm::BasicBlock *bb = llvm::BasicBlock::Create(context, "entry", f);
     builder.SetInsertPoint(bb);
-    CodegenEnv *e = new CodegenEnv(NULL);
+    slots.assign(func.num_slots, nullptr);
+    roots.clear();
+    root_slots.clear();
+    loop_header = nullptr;
+    loop_args.clear();
+    // A shadow-stack frame has to be popped after a call, so a self call
+    // in tail position cannot be a tail call. It branches back to a loop
+    // header after the entry block instead, reusing the frame and its
+    // roots.
+    if (gc_backend == GC_SHADOW_STACK && has_gc_roots &&
+        calls_itself(func.name, func.code)) {
+        loop_header = llvm::BasicBlock::Create(context, "tailrecurse", f);
+        builder.CreateBr(loop_header);
+        builder.SetInsertPoint(loop_header);
+    }
     int index = 0;
     for (auto &arg : f->args()) {
-        std::string name = func.args[index++];
-        arg.setName(name);
-        e->set(name, &arg);
+        arg.setName(func.args[index]);
+        llvm::Value *val = &arg;
+        if (loop_header != nullptr) {
+            llvm::PHINode *phi = builder.CreatePHI(arg.getType(), 2);
+            phi->addIncoming(&arg, bb);
+            loop_args.push_back(phi);
+            val = phi;
+        }
+        slots[index++] = val;
+    }
+    // The phis have to come first in the header, before any root store.
+    for (size_t i = 0; i < f->arg_size(); i++) {
+        slots[i] = root_value(slots[i]);
     }
 
-    gen_code(func.code, e);
+    if (!func.code.empty() && func.code.back().type == IR_RET) {
+        gen_tail_code(func.code, func.code.size() - 1);
+    } else {
+        gen_code(func.code);
+    }
     llvm::verifyFunction(*f);
 }
 
-void Codegen::gen_function_declare(IRFunc func) {
+void Codegen::gen_function_declare(const IRFunc &func) {
     std::vector<llvm::Type *> arg_types;
     for (int i = 0; i < func.arg_types.size(); i++) {
         Type *ty = func.arg_types[i];
@@ -348,6 +812,11 @@ void Codegen::gen_function_declare(IRFunc func) {
     name.append(func.name);
     llvm::Function *f = llvm::Function::Create(
         ft, llvm::Function::ExternalLinkage, name, module.get());
+    // otus functions call each other with fastcc so tail calls between them
+    // can be guaranteed. Externs and main keep the C convention.
+    if (!func.is_extern && func.name != "main") {
+        f->setCallingConv(llvm::CallingConv::Fast);
+    }
     // llvm::EHPersonality pers = llvm::EHPersonality::GNU_CXX;
     // std::string pers_name = llvm::getEHPersonalityName(pers);
     // module->getOrInsertFunction(pers_name,
@@ -355,22 +824,42 @@ void Codegen::gen_function_declare(IRFunc func) {
     // f->setPersonalityFn(module->getFunction(llvm::getEHPersonalityName(pers)));
 }
 
-void Codegen::gen_code(std::vector<IRInstr> code, CodegenEnv *e) {
-    for (auto instr : code) {
-        gen_instr(instr, e);
+void Codegen::gen_code(const std::vector<IRInstr> &code) {
+    for (auto &instr : code) {
+        gen_instr(instr);
     }
 }
 
 void Codegen::gc_alloc_init() {
+    llvm::Type *i64 = llvm::Type::getInt64Ty(context);
+    descriptor_type =
+        llvm::StructType::create(context, {i64, i64}, "TypeDescriptor");
     std::vector<llvm::Type *> arg_types;
-    llvm::Type *ty = llvm::Type::getInt64Ty(context);
-    arg_types.push_back(ty);
+    arg_types.push_back(llvm::PointerType::getUnqual(descriptor_type));
     llvm::Type *ret_type = llvm::Type::getInt8PtrTy(context);
     llvm::FunctionType *ft =
         llvm::FunctionType::get(ret_type, arg_types, false);
-    std::string name = "alloc";
+    std::string name = "alloc_typed";
     llvm::Function *f = llvm::Function::Create(
         ft, llvm::Function::ExternalLinkage, name, module.get());
+
+    // The nursery's bump region; see runtime/gc.hpp. It is a plain global
+    // for the JIT and becomes thread-local in object files.
+    llvm::Type *i8_ptr = llvm::Type::getInt8PtrTy(context);
+    llvm::StructType *nursery_type = llvm::StructType::create(
+        context, {i8_ptr, i8_ptr, i8_ptr, i8_ptr}, "Nursery");
+    new llvm::GlobalVariable(*module, nursery_type, false,
+                             llvm::GlobalValue::ExternalLinkage, nullptr,
+                             "otus_nursery");
+
+    // The write barrier of incremental collections.
+    new llvm::GlobalVariable(*module, llvm::Type::getInt8Ty(context), false,
+                             llvm::GlobalValue::ExternalLinkage, nullptr,
+                             "otus_gc_marking");
+    llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(context), {i8_ptr},
+                                false),
+        llvm::Function::ExternalLinkage, "otus_gc_shade", module.get());
 }
 
 void Codegen::gc_collect_init() {
@@ -399,6 +888,28 @@ void Codegen::gc_root_init() {
         ft, llvm::Function::ExternalLinkage, name, module.get());
 }
 
+// Have the runtime read the module's stack maps before main runs. LLVM
+// emits them into .llvm_stackmaps, whose start it labels __LLVM_StackMaps.
+void Codegen::gc_stack_map_init() {
+    llvm::Type *i8 = builder.getInt8Ty();
+    llvm::GlobalVariable *stack_map =
+        new llvm::GlobalVariable(*module, i8, true,
+                                 llvm::GlobalValue::ExternalLinkage, nullptr,
+                                 "__LLVM_StackMaps");
+    llvm::Function *add = llvm::Function::Create(
+        llvm::FunctionType::get(builder.getVoidTy(), {builder.getInt8PtrTy()},
+                                false),
+        llvm::Function::ExternalLinkage, "otus_gc_add_stack_map",
+        module.get());
+    llvm::Function *init = llvm::Function::Create(
+        llvm::FunctionType::get(builder.getVoidTy(), false),
+        llvm::Function::InternalLinkage, "otus.stack_map.init", module.get());
+    builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", init));
+    builder.CreateCall(add, {stack_map});
+    builder.CreateRetVoid();
+    llvm::appendToGlobalCtors(*module, init, 65535);
+}
+
 void Codegen::gc_setup() {
     gc_alloc_init();
     gc_collect_init();
@@ -407,18 +918,240 @@ void Codegen::gc_setup() {
 
 void Codegen::gen() {
     gc_setup();
+    ir.analyze_gc_effects();
 
-    for (auto func : ir.func_map) {
+    for (auto &func : ir.func_map) {
         gen_function_declare(func.second);
     }
-    for (auto func : ir.func_map) {
+    for (auto &func : ir.func_map) {
         gen_function(func.second);
     }
+    if (has_statepoints) {
+        gc_stack_map_init();
+    }
+}
+
+static bool is_scalar(Type *ty) {
+    return ty->kind == TY_INT || ty->kind == TY_FLOAT || ty->kind == TY_BOOL;
+}
+
+// Generate `i64 <name>.tier(i64* args)` for every function the VM can call
+// natively (see NativeEntry in bytecode.hpp). Only functions taking and
+// returning scalars qualify; their names are returned. Call after gen().
+std::set<std::string> Codegen::gen_tier_entries() {
+    std::set<std::string> names;
+    llvm::Type *i64 = builder.getInt64Ty();
+    llvm::FunctionType *entry_type = llvm::FunctionType::get(
+        i64, {llvm::PointerType::getUnqual(i64)}, false);
+    for (auto &i : ir.func_map) {
+        const IRFunc &func = i.second;
+        if (func.is_extern || func.name == "main") {
+            continue;
+        }
+        bool scalar =
+            func.ret_type->kind == TY_VOID || is_scalar(func.ret_type);
+        for (auto ty : func.arg_types) {
+            scalar = scalar && is_scalar(ty);
+        }
+        if (!scalar) {
+            continue;
+        }
+
+        llvm::Function *f = module->getFunction(func.name);
+        llvm::Function *entry =
+            llvm::Function::Create(entry_type, llvm::Function::ExternalLinkage,
+                                   func.name + ".tier", module.get());
+        builder.SetInsertPoint(
+            llvm::BasicBlock::Create(context, "entry", entry));
+        llvm::Value *args = entry->arg_begin();
+        std::vector<llvm::Value *> call_args;
+        for (unsigned k = 0; k < f->arg_size(); k++) {
+            llvm::Value *slot = builder.CreateConstGEP1_64(i64, args, k);
+            llvm::Value *word = builder.CreateLoad(i64, slot);
+            llvm::Type *ty = f->getFunctionType()->getParamType(k);
+            if (ty->isDoubleTy()) {
+                call_args.push_back(builder.CreateBitCast(word, ty));
+            } else {
+                call_args.push_back(builder.CreateTrunc(word, ty));
+            }
+        }
+        llvm::CallInst *call = builder.CreateCall(f, call_args);
+        call->setCallingConv(f->getCallingConv());
+        llvm::Type *ret_type = f->getReturnType();
+        if (ret_type->isVoidTy()) {
+            builder.CreateRet(builder.getInt64(0));
+        } else if (ret_type->isDoubleTy()) {
+            builder.CreateRet(builder.CreateBitCast(call, i64));
+        } else if (ret_type->isIntegerTy(1)) {
+            builder.CreateRet(builder.CreateZExt(call, i64));
+        } else {
+            builder.CreateRet(builder.CreateSExt(call, i64));
+        }
+        llvm::verifyFunction(*entry);
+        names.insert(func.name);
+    }
+    return names;
 }
 
 #include "llvm/CodeGen/CommandFlags.inc"
 
-void Codegen::generate_object_file(std::string output) {
+// Give each hot function a version for every feature list in `versions`,
+// next to the default one compiled for `features`, and turn the function
+// into an ifunc whose resolver picks the first version the CPU supports
+// when the program is loaded. Hot functions are the ones that loop and
+// cannot collect, so calls to them stay plain calls.
+void Codegen::multiversion(const std::vector<std::string> &versions,
+                           const std::string &features) {
+    const std::vector<std::string> dispatchable = {
+#define OTUS_CPU_FEATURE_NAME(name) name,
+        OTUS_CPU_FEATURES(OTUS_CPU_FEATURE_NAME)
+#undef OTUS_CPU_FEATURE_NAME
+    };
+    // The features of each version, and those the CPU must have for it.
+    std::vector<std::string> version_features;
+    std::vector<std::vector<std::string>> required;
+    for (auto &version : versions) {
+        std::string attr;
+        std::vector<std::string> needs;
+        std::stringstream list(version);
+        std::string feature;
+        while (std::getline(list, feature, ',')) {
+            if (feature.empty()) {
+                continue;
+            }
+            if (feature[0] != '+' && feature[0] != '-') {
+                feature = "+" + feature;
+            }
+            attr += (attr.empty() ? "" : ",") + feature;
+            if (feature[0] == '-') {
+                continue;
+            }
+            std::string name = feature.substr(1);
+            if (std::find(dispatchable.begin(), dispatchable.end(), name) ==
+                dispatchable.end()) {
+                error("cannot dispatch on CPU feature: %s", name.c_str());
+            }
+            needs.push_back(name);
+        }
+        version_features.push_back(features.empty() ? attr
+                                                    : features + "," + attr);
+        required.push_back(needs);
+    }
+
+    llvm::Function *supports = nullptr;
+    for (auto &entry : ir.func_map) {
+        IRFunc &func = entry.second;
+        if (func.is_extern || func.may_collect ||
+            !calls_itself(func.name, func.code)) {
+            continue;
+        }
+        if (supports == nullptr) {
+            supports = llvm::Function::Create(
+                llvm::FunctionType::get(builder.getInt32Ty(),
+                                        {builder.getInt8PtrTy()}, false),
+                llvm::Function::ExternalLinkage, "otus_cpu_supports",
+                module.get());
+        }
+        llvm::Function *f = module->getFunction(func.name);
+        f->setName(func.name + ".default");
+        llvm::Function *resolver = llvm::Function::Create(
+            llvm::FunctionType::get(f->getType(), false),
+            llvm::Function::InternalLinkage, func.name + ".resolver",
+            module.get());
+        llvm::GlobalIFunc *ifunc =
+            llvm::GlobalIFunc::create(f->getFunctionType(), 0, f->getLinkage(),
+                                      func.name, resolver, module.get());
+        // Other functions call through the ifunc; the recursive calls of
+        // each version stay within it.
+        std::vector<llvm::Use *> calls;
+        for (llvm::Use &use : f->uses()) {
+            auto inst = llvm::dyn_cast<llvm::Instruction>(use.getUser());
+            if (inst && inst->getFunction() != f) {
+                calls.push_back(&use);
+            }
+        }
+        for (auto use : calls) {
+            use->set(ifunc);
+        }
+        f->setLinkage(llvm::Function::InternalLinkage);
+
+        builder.SetInsertPoint(
+            llvm::BasicBlock::Create(context, "entry", resolver));
+        for (size_t i = 0; i < versions.size(); i++) {
+            llvm::ValueToValueMapTy vmap;
+            llvm::Function *clone = llvm::CloneFunction(f, vmap);
+            std::string suffix;
+            for (auto &name : required[i]) {
+                suffix += (suffix.empty() ? "" : "_") + name;
+            }
+            if (suffix.empty()) {
+                suffix = "v" + std::to_string(i + 1);
+            }
+            clone->setName(func.name + "." + suffix);
+            clone->addFnAttr("target-features", version_features[i]);
+            for (llvm::BasicBlock &bb : *clone) {
+                for (llvm::Instruction &inst : bb) {
+                    auto call = llvm::dyn_cast<llvm::CallInst>(&inst);
+                    if (call && call->getCalledFunction() == f) {
+                        call->setCalledFunction(clone);
+                    }
+                }
+            }
+
+            llvm::BasicBlock *next =
+                llvm::BasicBlock::Create(context, "next", resolver);
+            for (auto &name : required[i]) {
+                llvm::Value *has = builder.CreateCall(
+                    supports, {builder.CreateGlobalStringPtr(name)});
+                llvm::BasicBlock *more =
+                    llvm::BasicBlock::Create(context, "check", resolver);
+                builder.CreateCondBr(
+                    builder.CreateICmpNE(has, builder.getInt32(0)), more,
+                    next);
+                builder.SetInsertPoint(more);
+            }
+            builder.CreateRet(clone);
+            builder.SetInsertPoint(next);
+        }
+        builder.CreateRet(f);
+    }
+}
+
+// Runs the standard LLVM pipeline of the given level over the module:
+// mem2reg, inlining, GVN, loop and SLP vectorization and so on.
+static void optimize_module(llvm::Module &module, TargetMachine *target_machine,
+                            TargetLibraryInfoImpl &tlii, OptLevel opt_level) {
+    if (opt_level == OPT_O0) {
+        return;
+    }
+    llvm::PassBuilder::OptimizationLevel level =
+        opt_level == OPT_O1   ? llvm::PassBuilder::OptimizationLevel::O1
+        : opt_level == OPT_O2 ? llvm::PassBuilder::OptimizationLevel::O2
+        : opt_level == OPT_O3 ? llvm::PassBuilder::OptimizationLevel::O3
+                              : llvm::PassBuilder::OptimizationLevel::Os;
+    llvm::PipelineTuningOptions tuning;
+    tuning.LoopVectorization = opt_level != OPT_O1;
+    tuning.SLPVectorization = opt_level != OPT_O1;
+    llvm::PassBuilder pass_builder(target_machine, tuning);
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+    fam.registerPass([&] { return llvm::TargetLibraryAnalysis(tlii); });
+    pass_builder.registerModuleAnalyses(mam);
+    pass_builder.registerCGSCCAnalyses(cgam);
+    pass_builder.registerFunctionAnalyses(fam);
+    pass_builder.registerLoopAnalyses(lam);
+    pass_builder.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::ModulePassManager mpm =
+        pass_builder.buildPerModuleDefaultPipeline(level);
+    mpm.run(module, mam);
+}
+
+void Codegen::generate_object_file(std::string output, OptLevel opt_level,
+                                   const CPUTarget &cpu_target) {
     auto target_triple = llvm::sys::getDefaultTargetTriple();
     std::string error_str;
     auto target = llvm::TargetRegistry::lookupTarget(target_triple, error_str);
@@ -427,15 +1160,43 @@ void Codegen::generate_object_file(std::string output) {
         exit(1);
     }
 
-    auto cpu = "generic";
-    auto features = "";
+    std::string cpu = cpu_target.cpu;
+    std::string features = cpu_target.features;
+    if (cpu == "native") {
+        cpu = llvm::sys::getHostCPUName().str();
+        std::string host;
+        llvm::StringMap<bool> host_features;
+        if (llvm::sys::getHostCPUFeatures(host_features)) {
+            for (auto &feature : host_features) {
+                host += std::string(host.empty() ? "" : ",") +
+                        (feature.second ? "+" : "-") + feature.first().str();
+            }
+        }
+        // Features given explicitly come last and so take precedence.
+        features = features.empty() ? host : host + "," + features;
+    }
 
     llvm::TargetOptions opt = InitTargetOptionsFromCodeGenFlags();
+    opt.GuaranteedTailCallOpt = true;
 
     auto rm = llvm::Optional<llvm::Reloc::Model>();
-    TargetMachine *target_machine =
-        target->createTargetMachine(target_triple, cpu, features, opt, rm);
+    // Code generation keeps its default level below -O3; without it, deep
+    // recursion that does not become a jump overflows the stack sooner.
+    auto cg_level = opt_level == OPT_O3 ? llvm::CodeGenOpt::Aggressive
+                                        : llvm::CodeGenOpt::Default;
+    TargetMachine *target_machine = target->createTargetMachine(
+        target_triple, cpu, features, opt, rm, llvm::None, cg_level);
+    if (!target_machine->getMCSubtargetInfo()->isCPUStringValid(cpu)) {
+        error("unknown CPU: %s", cpu.c_str());
+    }
+    module->setTargetTriple(target_triple);
     module->setDataLayout(target_machine->createDataLayout());
+    // The runtime is linked into the executable, so its thread-locals can
+    // use the initial-exec model.
+    if (llvm::GlobalVariable *nursery =
+            module->getGlobalVariable("otus_nursery")) {
+        nursery->setThreadLocalMode(llvm::GlobalValue::InitialExecTLSModel);
+    }
 
     std::error_code ec;
     llvm::raw_fd_ostream dest(output, ec, llvm::sys::fs::OF_None);
@@ -445,15 +1206,22 @@ void Codegen::generate_object_file(std::string output) {
         exit(1);
     }
 
-    llvm::PassManagerBuilder *pm_builder =
-        new (std::nothrow) llvm::PassManagerBuilder();
-
+    // Versions are made before optimizing, so each is vectorized for its
+    // own features.
+    if (!cpu_target.versions.empty()) {
+        // Versions are dispatched through ifuncs, which only ELF has.
+        if (!Triple(target_triple).isOSBinFormatELF()) {
+            error("-mversion requires an ELF target");
+        }
+        multiversion(cpu_target.versions, features);
+    }
     TargetLibraryInfoImpl TLII(Triple(module->getTargetTriple()));
+    optimize_module(*module, target_machine, TLII, opt_level);
+    if (has_statepoints) {
+        insert_statepoints();
+    }
+
     llvm::legacy::PassManager pass;
-    // pass.add(new TargetLibraryInfoWrapperPass(TLII));
-    // pass.add(&TPC);
-    // pass.add(MMIWP);
-    // pass.add(llvm::createFreeMachineFunctionPass());
     auto file_type = llvm::CGFT_ObjectFile;
     if (target_machine->addPassesToEmitFile(pass, dest, nullptr, file_type,
                                             true)) {
@@ -465,4 +1233,11 @@ void Codegen::generate_object_file(std::string output) {
     dest.flush();
 }
 
+// Hand the module and its context over to the JIT. No more code can be
+// generated afterwards.
+llvm::orc::ThreadSafeModule Codegen::take_module() {
+    return llvm::orc::ThreadSafeModule(std::move(module),
+                                       std::move(owned_context));
+}
+
 void Codegen::print_code() { module->print(llvm::errs(), nullptr); }
@@ -9,6 +9,7 @@
 #include "llvm/CodeGen/GCStrategy.h"
 #include "llvm/CodeGen/LinkAllCodegenComponents.h"
 #include "llvm/CodeGen/MachineModuleInfo.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -17,12 +18,14 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/InitializePasses.h"
 #include "llvm/PassRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/Compiler.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
@@ -32,52 +35,118 @@
 #include "llvm/Target/TargetLoweringObjectFile.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
-#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include <map>
 #include <memory>
+#include <set>
 #include <stack>
+#include <string>
+#include <vector>
 
-typedef struct CodegenEnv CodegenEnv;
+// How compiled code tells the collector where its roots are.
+typedef enum GCBackend {
+    // LLVM's shadow stack: every function with roots links a frame into
+    // llvm_gc_root_chain (runtime/shadow_stack.hpp).
+    GC_SHADOW_STACK,
+    // Calls that may collect are statepoints; the collector finds the
+    // roots of each frame in the stack maps (runtime/stack_map.hpp).
+    GC_STATEPOINT,
+} GCBackend;
 
-struct CodegenEnv {
-    std::map<std::string, llvm::Value *> var_map;
-    CodegenEnv *parent;
+// Operand bundle of the root slots live across a call that will become a
+// statepoint.
+const char *const ROOTS_BUNDLE = "otus-roots";
 
-    CodegenEnv(CodegenEnv *parent) : parent{parent} {};
-    llvm::Value *get(std::string name) {
-        if (var_map.find(name) != var_map.end()) {
-            return var_map[name];
-        } else {
-            if (parent == NULL) {
-                return NULL;
-            } else {
-                return parent->get(name);
-            }
-        }
-    };
-    void set(std::string name, llvm::Value *val) { var_map[name] = val; };
+// Optimization level of object files, as with -O0..-O3 and -Os.
+typedef enum OptLevel {
+    OPT_O0,
+    OPT_O1,
+    OPT_O2,
+    OPT_O3,
+    OPT_OS,
+} OptLevel;
+
+// The CPU object files are compiled for, as with -march, -mcpu and -mattr.
+struct CPUTarget {
+    // An LLVM CPU name, or "native" for the host's CPU and features.
+    std::string cpu;
+    // LLVM features like "+avx2,-fma", added to those of the CPU.
+    std::string features;
+    // Feature sets to emit extra versions of hot functions for; see
+    // Codegen::multiversion.
+    std::vector<std::string> versions;
+
+    CPUTarget() : cpu{"generic"}, features{}, versions{} {}
 };
 
 class Codegen {
   private:
-    llvm::LLVMContext context;
+    // Owned until take_module hands it over together with the module.
+    std::unique_ptr<llvm::LLVMContext> owned_context;
+    llvm::LLVMContext &context;
     llvm::IRBuilder<> builder;
     std::unique_ptr<llvm::Module> module;
-    IR ir;
+    IR &ir;
     std::stack<llvm::Value *> stack;
-    std::stack<std::vector<IRInstr>> code_stack;
+    std::stack<const std::vector<IRInstr> *> code_stack;
+    // Values of the current function's variables, indexed by IR slot.
+    std::vector<llvm::Value *> slots;
+    GCBackend gc_backend;
+    // Whether the current function registers gcroots.
+    bool has_gc_roots;
+    // Whether any call will become a statepoint, and so a stack map will be
+    // emitted.
+    bool has_statepoints;
+    // Root slot of each heap pointer value of the current function. The
+    // collector may move objects, so the values are reloaded from their
+    // slots after anything that can collect.
+    std::map<llvm::Value *, llvm::AllocaInst *> roots;
+    // Every root slot of the current function. A slot is reused once no
+    // value in the variables or on the stack is kept in it any more.
+    std::vector<llvm::AllocaInst *> root_slots;
+    // The block self calls in tail position branch back to, when they
+    // cannot be tail calls, and the phis of the arguments there.
+    llvm::BasicBlock *loop_header;
+    std::vector<llvm::PHINode *> loop_args;
+
+    bool is_gc_pointer(llvm::Type *ty);
+    std::vector<llvm::AllocaInst *> live_root_slots();
+    llvm::AllocaInst *root_slot(llvm::Type *ty);
+    llvm::Value *root_value(llvm::Value *val);
+    llvm::Value *reload(llvm::Value *val);
+    void reload_roots();
+    llvm::Value *gen_safepoint_call(llvm::Function *callee,
+                                    llvm::ArrayRef<llvm::Value *> args);
+    void insert_statepoints();
+    void multiversion(const std::vector<std::string> &versions,
+                      const std::string &features);
+    void gen_write_barrier(llvm::Value *obj, llvm::Value *val);
+    // The runtime's TypeDescriptor and the descriptor emitted for each
+    // allocated type.
+    llvm::StructType *descriptor_type;
+    std::map<llvm::Type *, llvm::GlobalVariable *> descriptors;
+    llvm::GlobalVariable *type_descriptor(llvm::Type *ty);
+    llvm::Value *gen_alloc(llvm::Type *ty);
 
   public:
-    Codegen(IR ir);
-    void gen_instr(IRInstr instr, CodegenEnv *e);
+    Codegen(IR &ir, GCBackend gc_backend = GC_SHADOW_STACK);
+    void gen_instr(const IRInstr &instr);
+    llvm::Value *gen_call(const IRInstr &instr, bool tail = false);
+    void gen_tail_code(const std::vector<IRInstr> &code, size_t count);
+    void gen_loop_back();
     llvm::Type *convert_type_to_llvm_type(Type *ty);
-    void gen_function(IRFunc func);
-    void gen_function_declare(IRFunc func);
-    void gen_code(std::vector<IRInstr> code, CodegenEnv *e);
+    void gen_function(const IRFunc &func);
+    void gen_function_declare(const IRFunc &func);
+    void gen_code(const std::vector<IRInstr> &code);
     void gc_alloc_init();
     void gc_collect_init();
     void gc_root_init();
+    void gc_stack_map_init();
     void gc_setup();
     void gen();
-    void generate_object_file(std::string output);
+    std::set<std::string> gen_tier_entries();
+    void generate_object_file(std::string output,
+                              OptLevel opt_level = OPT_O0,
+                              const CPUTarget &cpu_target = CPUTarget());
+    llvm::orc::ThreadSafeModule take_module();
     void print_code();
 };
@@ -2,13 +2,17 @@
 #include "parser.hpp"
 
 IRInstr::IRInstr(IRInstrType type, Obj *operand)
-    : type{type}, operand{operand} {}
+    : type{type}, operand{operand}, slot{-1} {}
 
 IRFunc::IRFunc(std::vector<std::string> args, std::vector<Type *> arg_types,
                Type *ret_type, std::vector<IRInstr> code, std::string name)
     : args{args}, arg_types{arg_types}, ret_type{ret_type}, code{code},
-      name{name} {}
-IRFunc::IRFunc() {}
+      name{name}, num_slots{0}, is_extern{false}, no_gc{false},
+      may_collect{true} {}
+IRFunc::IRFunc()
+    : num_slots{0}, is_extern{false}, no_gc{false}, may_collect{true} {}
+
+IR::IR() {}
 
 IR::IR(std::vector<Node *> nodes) {
     std::vector<std::string> dummy_arg;
@@ -27,9 +31,56 @@ IR::IR(std::vector<Node *> nodes) {
     Type *ret_type = new Type(TY_INT);
     IRFunc func(dummy_arg, dummy_types, ret_type, code, "main");
     func_map["main"] = func;
+
+    for (auto &i : func_map) {
+        if (!i.second.is_extern) {
+            resolve_slots(i.second);
+        }
+    }
+}
+
+IRFunc &IR::get_func(const std::string &name) { return func_map[name]; }
+
+// Whether `code` allocates or calls a function that may collect, as far as
+// is known yet.
+static bool code_may_collect(IR &ir, const std::vector<IRInstr> &code) {
+    for (auto &instr : code) {
+        if (instr.type == IR_ALLOC) {
+            return true;
+        } else if (instr.type == IR_CALL) {
+            auto callee = ir.func_map.find(instr.operand->name);
+            if (callee == ir.func_map.end() || callee->second.may_collect) {
+                return true;
+            }
+        } else if (instr.type == IR_PUSH && instr.operand->type == OBJ_CODE &&
+                   code_may_collect(ir, instr.operand->code)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-IRFunc IR::get_func(std::string name) { return func_map[name]; }
+// Compute IRFunc::may_collect over the call graph: allocating may collect,
+// and so may calling an extern not declared nogc or a function that may
+// collect. Starting from no function collecting, functions are marked
+// until nothing changes, so recursion alone does not make one collect.
+void IR::analyze_gc_effects() {
+    for (auto &i : func_map) {
+        i.second.may_collect = i.second.is_extern && !i.second.no_gc;
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto &i : func_map) {
+            IRFunc &func = i.second;
+            if (!func.may_collect && !func.is_extern &&
+                code_may_collect(*this, func.code)) {
+                func.may_collect = true;
+                changed = true;
+            }
+        }
+    }
+}
 
 void IR::gen_ir(Node *node, std::vector<IRInstr> &code) {
     if (node->type == ND_NUMBER) {
@@ -191,6 +242,7 @@ void IR::gen_ir(Node *node, std::vector<IRInstr> &code) {
         IRFunc new_func(node->let_extern.args, arg_types, ret_type, dummy_body,
                         node->let_extern.name);
         new_func.is_extern = true;
+        new_func.no_gc = node->let_extern.no_gc;
 
         func_map[node->let_extern.name] = new_func;
     } else if (node->type == ND_APP) {
@@ -215,6 +267,41 @@ void IR::gen_ir(Node *node, std::vector<IRInstr> &code) {
     }
 }
 
+// Assign every argument and let-bound name of `func` a frame slot so that
+// backends address variables by index instead of by name. Arguments take
+// slots [0, args.size()). Slots bound inside an if/else body are released
+// when the body ends, so the two branches share them.
+void IR::resolve_slots(IRFunc &func) {
+    std::map<std::string, int> scope;
+    int num_args = func.args.size();
+    for (int i = 0; i < num_args; i++) {
+        scope[func.args[i]] = i;
+    }
+    func.num_slots = num_args;
+    resolve_code(func, func.code, scope, num_args);
+}
+
+void IR::resolve_code(IRFunc &func, std::vector<IRInstr> &code,
+                      std::map<std::string, int> scope, int next_slot) {
+    for (auto &instr : code) {
+        if (instr.type == IR_STORE) {
+            instr.slot = next_slot++;
+            scope[instr.operand->name] = instr.slot;
+            if (next_slot > func.num_slots) {
+                func.num_slots = next_slot;
+            }
+        } else if (instr.type == IR_LOAD) {
+            auto it = scope.find(instr.operand->name);
+            if (it == scope.end()) {
+                error("undeclared variable: %s", instr.operand->name.c_str());
+            }
+            instr.slot = it->second;
+        } else if (instr.type == IR_PUSH && instr.operand->type == OBJ_CODE) {
+            resolve_code(func, instr.operand->code, scope, next_slot);
+        }
+    }
+}
+
 void IRInstr::print_instr() {
     if (type == IR_ADD) {
         std::cout << "ADD";
@@ -230,10 +317,10 @@ void IRInstr::print_instr() {
         std::cout << "PUSH ";
         operand->print_obj();
     } else if (type == IR_STORE) {
-        std::cout << "STORE";
+        std::cout << "STORE " << slot << " ";
         operand->print_obj();
     } else if (type == IR_LOAD) {
-        std::cout << "LOAD ";
+        std::cout << "LOAD " << slot << " ";
         operand->print_obj();
     } else if (type == IR_CALL) {
         std::cout << "CALL";
@@ -279,7 +366,7 @@ void IRFunc::print_ir_func() {
 }
 
 void IR::print_ir() {
-    for (auto i : func_map) {
+    for (auto &i : func_map) {
         i.second.print_ir_func();
     }
 }
@@ -46,6 +46,9 @@ class IRInstr {
   public:
     IRInstrType type;
     Obj *operand;
+    // Frame slot of the variable accessed by IR_LOAD/IR_STORE, assigned by
+    // IR::resolve_slots.
+    int slot;
 
     IRInstr(IRInstrType type, Obj *operand);
     void print_instr();
@@ -58,7 +61,13 @@ class IRFunc {
     std::vector<Type *> arg_types;
     Type *ret_type;
     std::string name;
+    int num_slots;
     bool is_extern;
+    // Set on externs declared `let extern nogc`.
+    bool no_gc;
+    // Whether calling the function may run a collection; see
+    // IR::analyze_gc_effects. Conservatively true until then.
+    bool may_collect;
 
     IRFunc(std::vector<std::string> args, std::vector<Type *> arg_types,
            Type *ret_type, std::vector<IRInstr> code, std::string name);
@@ -70,9 +79,14 @@ class IR {
   public:
     std::map<std::string, IRFunc> func_map;
 
+    IR();
     IR(std::vector<Node *> nodes);
     void gen_ir(Node *node, std::vector<IRInstr> &code);
-    IRFunc get_func(std::string name);
+    void resolve_slots(IRFunc &func);
+    void resolve_code(IRFunc &func, std::vector<IRInstr> &code,
+                      std::map<std::string, int> scope, int next_slot);
+    IRFunc &get_func(const std::string &name);
+    void analyze_gc_effects();
     void print_ir();
 };
 
@@ -103,6 +117,10 @@ struct Obj {
     void print_obj() {
         if (type == OBJ_INT) {
             std::cout << number;
+        } else if (type == OBJ_FLOAT) {
+            std::cout << float_number;
+        } else if (type == OBJ_BOOL) {
+            std::cout << (bool_val ? "true" : "false");
         } else if (type == OBJ_NAME) {
             std::cout << name;
         } else if (type == OBJ_CODE) {
@@ -0,0 +1,90 @@
+#include "jit.hpp"
+#include "error.hpp"
+#include "runtime/gc.hpp"
+#include "runtime/runtime.hpp"
+
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/Support/Error.h"
+
+#include <iostream>
+
+struct StackEntry;
+extern StackEntry *llvm_gc_root_chain;
+
+// The builtins otus programs declare with `let extern`. Native builds get
+// them from examples/lib.cpp.
+static void jit_println(char *str) { std::cout << str << std::endl; }
+
+static void jit_print_int(int i) { std::cout << i << std::endl; }
+
+static void jit_print_float(double f) { std::cout << f << std::endl; }
+
+static void jit_run_collect() { collect(); }
+
+template <typename T> static T check(llvm::Expected<T> value) {
+    if (!value) {
+        error("jit: %s", llvm::toString(value.takeError()).c_str());
+    }
+    return std::move(*value);
+}
+
+static void check(llvm::Error err) {
+    if (err) {
+        error("jit: %s", llvm::toString(std::move(err)).c_str());
+    }
+}
+
+JIT::JIT() {
+    auto jtmb = check(llvm::orc::JITTargetMachineBuilder::detectHost());
+    // Codegen relies on guaranteed tail calls between fastcc functions.
+    jtmb.getOptions().GuaranteedTailCallOpt = true;
+    lljit = check(llvm::orc::LLLazyJITBuilder()
+                      .setJITTargetMachineBuilder(std::move(jtmb))
+                      .create());
+    define_runtime_symbols();
+}
+
+void JIT::define_runtime_symbols() {
+    llvm::orc::JITDylib &dylib = lljit->getMainJITDylib();
+    llvm::orc::SymbolMap symbols;
+    auto add = [&](const char *name, void *addr) {
+        symbols[lljit->mangleAndIntern(name)] = llvm::JITEvaluatedSymbol(
+            llvm::pointerToJITTargetAddress(addr),
+            llvm::JITSymbolFlags::Exported);
+    };
+    add("alloc", (void *)&alloc);
+    add("alloc_typed", (void *)&alloc_typed);
+    add("collect", (void *)&collect);
+    // Jitted code runs on the thread that created the JIT, so the nursery
+    // is bound to that thread's instance as a plain global.
+    add("otus_nursery", (void *)&otus_nursery);
+    add("otus_gc_marking", (void *)&otus_gc_marking);
+    add("otus_gc_shade", (void *)&otus_gc_shade);
+    add("llvm_gc_root_chain", (void *)&llvm_gc_root_chain);
+    add("println", (void *)&jit_println);
+    add("print_int", (void *)&jit_print_int);
+    add("print_float", (void *)&jit_print_float);
+    add("run_collect", (void *)&jit_run_collect);
+    check(dylib.define(llvm::orc::absoluteSymbols(symbols)));
+
+    // Any other extern resolves against the symbols of the otus process.
+    char prefix = lljit->getDataLayout().getGlobalPrefix();
+    dylib.addGenerator(
+        check(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            prefix)));
+}
+
+void JIT::add_module(llvm::orc::ThreadSafeModule module) {
+    check(lljit->addLazyIRModule(std::move(module)));
+}
+
+void *JIT::lookup(std::string name) {
+    llvm::JITEvaluatedSymbol sym = check(lljit->lookup(name));
+    return llvm::jitTargetAddressToPointer<void *>(sym.getAddress());
+}
+
+int JIT::run_main() {
+    int (*main_func)() = (int (*)())lookup("main");
+    return main_func();
+}
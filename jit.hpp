@@ -0,0 +1,23 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+
+#include <memory>
+#include <string>
+
+// In-process execution of generated code. Functions are compiled lazily the
+// first time they are called, and the runtime symbols (alloc, collect and
+// the builtins of examples/lib.cpp) resolve to the copies linked into otus.
+class JIT {
+  private:
+    std::unique_ptr<llvm::orc::LLLazyJIT> lljit;
+
+    void define_runtime_symbols();
+
+  public:
+    JIT();
+    void add_module(llvm::orc::ThreadSafeModule module);
+    void *lookup(std::string name);
+    int run_main();
+};
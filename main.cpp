@@ -4,27 +4,74 @@
 #include <ostream>
 #include <vector>
 
-#include "codegen.hpp"
 #include "error.hpp"
 #include "ir.hpp"
 #include "lexer.hpp"
+#include "otc.hpp"
 #include "parser.hpp"
 #include "typing.hpp"
 #include "vm.hpp"
 
+// otus-vm (make otus-vm) is built with OTUS_VM_ONLY and does not link
+// against LLVM at all.
+#ifndef OTUS_VM_ONLY
+#include "codegen.hpp"
+#include "jit.hpp"
+#include "tier.hpp"
+#endif
+
 class Config {
   public:
     bool run_with_vm;
+    bool run_with_jit;
+    bool run_tiered;
     std::string input_file;
     std::string output_file;
+    std::string ir_file;
+    bool use_statepoints;
+    // -O0, -O1, -O2, -O3 or -Os.
+    std::string opt_level;
+    std::string cpu;
+    std::string cpu_features;
+    std::vector<std::string> cpu_versions;
 
-    Config() : run_with_vm{false}, input_file{}, output_file{} {}
+    Config()
+        : run_with_vm{false}, run_with_jit{false}, run_tiered{false},
+          input_file{}, output_file{}, ir_file{}, use_statepoints{false},
+          opt_level{"-O0"}, cpu{"generic"}, cpu_features{}, cpu_versions{} {}
 
     void print_usage() {
         std::cout << "Usage: otus [OPTIONS] [INPUT]" << std::endl;
         std::cout << "OPTIONS:" << std::endl;
         std::cout << "\t-o <output>\t\tSpecify output object file."
                   << std::endl;
+        std::cout << "\t-emit-ir <output>\tWrite precompiled IR (.otc)."
+                  << std::endl;
+        std::cout << "\t-vm\t\t\tRun the program with the bytecode VM."
+                  << std::endl;
+        std::cout << "\t-jit\t\t\tCompile and run the program in-process."
+                  << std::endl;
+        std::cout << "\t-tier\t\t\tRun with the VM, compiling hot functions."
+                  << std::endl;
+        std::cout << "\t-gc <backend>\t\tFind GC roots with shadow-stack "
+                     "(default) or"
+                  << std::endl;
+        std::cout << "\t\t\t\tstatepoint stack maps (object files only)."
+                  << std::endl;
+        std::cout << "\t-O0 -O1 -O2 -O3 -Os\tOptimization level of the object "
+                     "file."
+                  << std::endl;
+        std::cout << "\t-mcpu=<cpu>\t\tCompile for an LLVM CPU name, or native "
+                     "for"
+                  << std::endl;
+        std::cout << "\t\t\t\tthe host (also -march=<cpu>)." << std::endl;
+        std::cout << "\t-mattr=<features>\tEnable or disable CPU features, "
+                     "e.g. +avx2,-fma."
+                  << std::endl;
+        std::cout << "\t-mversion=<features>\tAlso emit versions of hot "
+                     "functions using"
+                  << std::endl;
+        std::cout << "\t\t\t\tthe features, picked at load time." << std::endl;
     }
 
     void parse_argv(int argc, char **argv) {
@@ -40,8 +87,36 @@ class Config {
                 if (arg == "-o") {
                     cur++;
                     output_file = std::string(argv[cur]);
+                } else if (arg == "-emit-ir") {
+                    cur++;
+                    ir_file = std::string(argv[cur]);
                 } else if (arg == "-vm") {
                     run_with_vm = true;
+                } else if (arg == "-jit") {
+                    run_with_jit = true;
+                } else if (arg == "-tier") {
+                    run_tiered = true;
+                } else if (arg == "-gc") {
+                    cur++;
+                    std::string backend(argv[cur]);
+                    if (backend == "statepoint") {
+                        use_statepoints = true;
+                    } else if (backend == "shadow-stack") {
+                        use_statepoints = false;
+                    } else {
+                        error("unknown GC backend: %s", backend.c_str());
+                    }
+                } else if (arg == "-O0" || arg == "-O1" || arg == "-O2" ||
+                           arg == "-O3" || arg == "-Os") {
+                    opt_level = arg;
+                } else if (arg.compare(0, 7, "-march=") == 0) {
+                    cpu = arg.substr(7);
+                } else if (arg.compare(0, 6, "-mcpu=") == 0) {
+                    cpu = arg.substr(6);
+                } else if (arg.compare(0, 7, "-mattr=") == 0) {
+                    cpu_features = arg.substr(7);
+                } else if (arg.compare(0, 10, "-mversion=") == 0) {
+                    cpu_versions.push_back(arg.substr(10));
                 } else if (arg == "--help") {
                     print_usage();
                     std::exit(0);
@@ -55,33 +130,14 @@ class Config {
     }
 };
 
-int main(int argc, char **argv) {
-    llvm::InitializeAllTargetInfos();
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllTargetMCs();
-    llvm::InitializeAllAsmParsers();
-    llvm::InitializeAllAsmPrinters();
-
-    // llvm::PassRegistry *Registry = llvm::PassRegistry::getPassRegistry();
-    // initializeCore(*Registry);
-    // initializeCodeGen(*Registry);
-    // initializeLoopStrengthReducePass(*Registry);
-    // initializeLowerIntrinsicsPass(*Registry);
-
-    llvm::linkAllBuiltinGCs();
-
-    Config config;
-    config.parse_argv(argc, argv);
-    if (config.input_file.empty()) {
-        error("input file unspecified");
-    }
-    std::ifstream file(config.input_file);
+static IR front_end(const std::string &input_file) {
+    std::ifstream file(input_file);
     std::string buf;
     if (file.is_open()) {
         buf = std::string((std::istreambuf_iterator<char>(file)),
                           (std::istreambuf_iterator<char>()));
     } else {
-        error("could not open the file: %s", argv[1]);
+        error("could not open the file: %s", input_file.c_str());
     }
 
     // std::cout << buf << std::endl;
@@ -91,18 +147,75 @@ int main(int argc, char **argv) {
     std::vector<Node *> nodes = parser.parse_all();
     Typing typing(nodes);
     std::vector<Node *> typed_nodes = typing.infer();
-    IR ir(typed_nodes);
+    return IR(typed_nodes);
+}
+
+int main(int argc, char **argv) {
+    Config config;
+    config.parse_argv(argc, argv);
+    if (config.input_file.empty()) {
+        error("input file unspecified");
+    }
+#ifdef OTUS_VM_ONLY
+    if (config.run_with_jit || config.run_tiered ||
+        !config.output_file.empty()) {
+        error("otus-vm is built without LLVM; use -vm or -emit-ir");
+    }
+    config.run_with_vm = true;
+#endif
+    IR ir;
+    if (is_otc_file(config.input_file)) {
+        // Precompiled IR skips the whole front end.
+        IRReader reader;
+        reader.read(config.input_file, ir);
+    } else {
+        ir = front_end(config.input_file);
+    }
     // ir.print_ir();
+    if (!config.ir_file.empty()) {
+        IRWriter writer;
+        writer.write(ir, config.ir_file);
+        return 0;
+    }
+    // LLVM is only initialized once Codegen is first used, so the VM never
+    // pays for it.
     if (config.run_with_vm) {
         VM vm(ir);
-        Obj *ret = vm.run_main();
-        ret->print_obj();
-    } else {
+        Value ret = vm.run_main();
+        ret.print_value();
+        return 0;
+    }
+#ifndef OTUS_VM_ONLY
+    if (config.run_tiered) {
+        VM vm(ir);
+        JITTier tier(ir);
+        vm.set_tier(&tier);
+        Value ret = vm.run_main();
+        ret.print_value();
+    } else if (config.run_with_jit) {
         Codegen codegen(ir);
         codegen.gen();
+        JIT jit;
+        jit.add_module(codegen.take_module());
+        return jit.run_main();
+    } else {
+        Codegen codegen(ir, config.use_statepoints ? GC_STATEPOINT
+                                                   : GC_SHADOW_STACK);
+        codegen.gen();
         codegen.print_code();
-        codegen.generate_object_file(config.output_file);
+        OptLevel opt_level = config.opt_level == "-O1"   ? OPT_O1
+                             : config.opt_level == "-O2" ? OPT_O2
+                             : config.opt_level == "-O3" ? OPT_O3
+                             : config.opt_level == "-Os" ? OPT_OS
+                                                         : OPT_O0;
+        CPUTarget cpu_target;
+        cpu_target.cpu = config.cpu;
+        cpu_target.features = config.cpu_features;
+        cpu_target.versions = config.cpu_versions;
+        codegen.generate_object_file(config.output_file, opt_level,
+                                     cpu_target);
     }
+#endif
     // VM vm(ir);
     // Obj *obj = vm.run_main();
     // obj->print_obj();
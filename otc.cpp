@@ -0,0 +1,319 @@
+#include "otc.hpp"
+#include "ir.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void IRWriter::put_u32(uint32_t val) {
+    for (int i = 0; i < 4; i++) {
+        buf.push_back((char)(val >> (i * 8)));
+    }
+}
+
+void IRWriter::put_u64(uint64_t val) {
+    put_u32((uint32_t)val);
+    put_u32((uint32_t)(val >> 32));
+}
+
+void IRWriter::put_f64(double val) {
+    uint64_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    put_u64(bits);
+}
+
+void IRWriter::put_str(const std::string &str) {
+    put_u32(str.size());
+    buf.append(str);
+}
+
+void IRWriter::put_type(Type *ty) {
+    put_u32(ty ? type_index[ty] : OTC_NO_TYPE);
+}
+
+// Number every type reachable from the IR, children before their parents,
+// so the reader can resolve each index as soon as it sees it.
+void IRWriter::collect_type(Type *ty) {
+    if (!ty || type_index.count(ty)) {
+        return;
+    }
+    for (auto arg : ty->arg_types) {
+        collect_type(arg);
+    }
+    if (ty->kind == TY_FUN) {
+        collect_type(ty->ret_type);
+    } else if (ty->kind == TY_PTR) {
+        collect_type(ty->ptr_to);
+    }
+    type_index[ty] = types.size();
+    types.push_back(ty);
+}
+
+void IRWriter::collect_code(const std::vector<IRInstr> &code) {
+    for (auto &instr : code) {
+        if (!instr.operand) {
+            continue;
+        }
+        if (instr.operand->type == OBJ_TYPE) {
+            collect_type(instr.operand->ty);
+        } else if (instr.operand->type == OBJ_CODE) {
+            collect_code(instr.operand->code);
+        }
+    }
+}
+
+void IRWriter::put_code(const std::vector<IRInstr> &code) {
+    put_u32(code.size());
+    for (auto &instr : code) {
+        put_u32(instr.type);
+        put_u32(instr.slot);
+        Obj *obj = instr.operand;
+        if (!obj) {
+            put_u32(OTC_NO_OPERAND);
+            continue;
+        }
+        put_u32(obj->type);
+        if (obj->type == OBJ_INT) {
+            put_u32(obj->number);
+        } else if (obj->type == OBJ_FLOAT) {
+            put_f64(obj->float_number);
+        } else if (obj->type == OBJ_BOOL) {
+            put_u32(obj->bool_val);
+        } else if (obj->type == OBJ_NAME) {
+            put_str(obj->name);
+            put_u64(obj->size);
+        } else if (obj->type == OBJ_CODE) {
+            put_code(obj->code);
+        } else if (obj->type == OBJ_STRING) {
+            put_str(obj->str);
+        } else if (obj->type == OBJ_TYPE) {
+            put_type(obj->ty);
+        }
+    }
+}
+
+void IRWriter::write(IR &ir, const std::string &path) {
+    for (auto &i : ir.func_map) {
+        IRFunc &func = i.second;
+        for (auto ty : func.arg_types) {
+            collect_type(ty);
+        }
+        collect_type(func.ret_type);
+        collect_code(func.code);
+    }
+
+    buf.clear();
+    buf.append(OTC_MAGIC, sizeof(OTC_MAGIC));
+    put_u32(OTC_VERSION);
+    size_t size_at = buf.size();
+    put_u64(0);
+    put_u32(types.size());
+    put_u32(ir.func_map.size());
+
+    for (auto ty : types) {
+        put_u32(ty->kind);
+        put_str(ty->typevar);
+        put_u32(ty->arg_types.size());
+        for (auto arg : ty->arg_types) {
+            put_type(arg);
+        }
+        put_type(ty->kind == TY_FUN ? ty->ret_type : nullptr);
+        put_type(ty->kind == TY_PTR ? ty->ptr_to : nullptr);
+    }
+
+    for (auto &i : ir.func_map) {
+        IRFunc &func = i.second;
+        put_str(func.name);
+        // Bit 0: extern, bit 1: nogc.
+        put_u32(func.is_extern | func.no_gc << 1);
+        put_u32(func.num_slots);
+        put_u32(func.args.size());
+        for (size_t k = 0; k < func.args.size(); k++) {
+            put_str(func.args[k]);
+            put_type(func.arg_types[k]);
+        }
+        put_type(func.ret_type);
+        put_code(func.code);
+    }
+
+    uint64_t size = buf.size();
+    for (int i = 0; i < 8; i++) {
+        buf[size_at + i] = (char)(size >> (i * 8));
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        error("could not open the file: %s", path.c_str());
+    }
+    file.write(buf.data(), buf.size());
+    if (!file) {
+        error("could not write the file: %s", path.c_str());
+    }
+}
+
+IRReader::IRReader() : data{nullptr}, size{0}, pos{0} {}
+
+IRReader::~IRReader() {
+    if (data) {
+        munmap((void *)data, size);
+    }
+}
+
+uint32_t IRReader::get_u32() {
+    if (size - pos < 4) {
+        error("truncated otc file");
+    }
+    uint32_t val = 0;
+    for (int i = 0; i < 4; i++) {
+        val |= (uint32_t)(unsigned char)data[pos++] << (i * 8);
+    }
+    return val;
+}
+
+uint64_t IRReader::get_u64() {
+    uint64_t low = get_u32();
+    return low | (uint64_t)get_u32() << 32;
+}
+
+double IRReader::get_f64() {
+    uint64_t bits = get_u64();
+    double val;
+    std::memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+std::string IRReader::get_str() {
+    uint32_t len = get_u32();
+    if (size - pos < len) {
+        error("truncated otc file");
+    }
+    std::string str(data + pos, len);
+    pos += len;
+    return str;
+}
+
+Type *IRReader::get_type() {
+    uint32_t index = get_u32();
+    if (index == OTC_NO_TYPE) {
+        return nullptr;
+    }
+    if (index >= types.size()) {
+        error("invalid type index in otc file");
+    }
+    return types[index];
+}
+
+std::vector<IRInstr> IRReader::get_code() {
+    std::vector<IRInstr> code;
+    uint32_t count = get_u32();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t type = get_u32();
+        if (type > IR_RET) {
+            error("invalid instruction in otc file");
+        }
+        int slot = (int)get_u32();
+        uint32_t tag = get_u32();
+        Obj *obj = nullptr;
+        if (tag != OTC_NO_OPERAND) {
+            obj = new Obj((ObjType)tag);
+            if (tag == OBJ_INT) {
+                obj->number = (int)get_u32();
+            } else if (tag == OBJ_FLOAT) {
+                obj->float_number = get_f64();
+            } else if (tag == OBJ_BOOL) {
+                obj->bool_val = get_u32() != 0;
+            } else if (tag == OBJ_NAME) {
+                obj->name = get_str();
+                obj->size = get_u64();
+            } else if (tag == OBJ_CODE) {
+                obj->code = get_code();
+            } else if (tag == OBJ_STRING) {
+                obj->str = get_str();
+            } else if (tag == OBJ_TYPE) {
+                obj->ty = get_type();
+            } else {
+                error("invalid operand in otc file");
+            }
+        }
+        IRInstr instr((IRInstrType)type, obj);
+        instr.slot = slot;
+        code.push_back(instr);
+    }
+    return code;
+}
+
+// Map `path` and rebuild the IR it holds into `ir`. The IR is already
+// slot-resolved, so it goes straight to a backend.
+void IRReader::read(const std::string &path, IR &ir) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error("could not open the file: %s", path.c_str());
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        error("could not read the file: %s", path.c_str());
+    }
+    size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error("could not map the file: %s", path.c_str());
+    }
+    data = (const char *)map;
+    pos = 0;
+
+    if (size < sizeof(OTC_MAGIC) ||
+        std::memcmp(data, OTC_MAGIC, sizeof(OTC_MAGIC)) != 0) {
+        error("not an otc file: %s", path.c_str());
+    }
+    pos = sizeof(OTC_MAGIC);
+    uint32_t version = get_u32();
+    if (version != OTC_VERSION) {
+        error("otc file version %u is not supported (expected %u)", version,
+              OTC_VERSION);
+    }
+    if (get_u64() != size) {
+        error("corrupt otc file: %s", path.c_str());
+    }
+    uint32_t num_types = get_u32();
+    uint32_t num_funcs = get_u32();
+
+    for (uint32_t i = 0; i < num_types; i++) {
+        Type *ty = new Type((TypeKind)get_u32());
+        ty->typevar = get_str();
+        uint32_t num_args = get_u32();
+        for (uint32_t k = 0; k < num_args; k++) {
+            ty->arg_types.push_back(get_type());
+        }
+        ty->ret_type = get_type();
+        ty->ptr_to = get_type();
+        types.push_back(ty);
+    }
+
+    for (uint32_t i = 0; i < num_funcs; i++) {
+        IRFunc func;
+        func.name = get_str();
+        uint32_t flags = get_u32();
+        func.is_extern = flags & 1;
+        func.no_gc = flags & 2;
+        func.num_slots = get_u32();
+        uint32_t num_args = get_u32();
+        for (uint32_t k = 0; k < num_args; k++) {
+            func.args.push_back(get_str());
+            func.arg_types.push_back(get_type());
+        }
+        func.ret_type = get_type();
+        func.code = get_code();
+        ir.func_map[func.name] = func;
+    }
+}
+
+bool is_otc_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(OTC_MAGIC)];
+    return file.read(magic, sizeof(magic)) &&
+           std::memcmp(magic, OTC_MAGIC, sizeof(magic)) == 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "error.hpp"
+#include "ir.hpp"
+
+// Precompiled IR (.otc files), written by `otus -emit-ir` and run without
+// the front end. The file starts with a header (magic, version, file size,
+// number of types and functions) followed by the type table and the
+// functions, all little-endian fixed-width fields and length-prefixed
+// strings. Types are referred to by their index in the table, so the file
+// holds no pointers and is read straight from its mapping.
+const char OTC_MAGIC[4] = {'O', 'T', 'C', '\0'};
+// Bump whenever the layout or the IR instruction set changes.
+const uint32_t OTC_VERSION = 1;
+// Type index standing for a null Type pointer.
+const uint32_t OTC_NO_TYPE = 0xffffffff;
+// Operand tag of instructions without an operand.
+const uint32_t OTC_NO_OPERAND = 0xffffffff;
+
+class IRWriter {
+  private:
+    std::string buf;
+    std::map<Type *, uint32_t> type_index;
+    std::vector<Type *> types;
+
+    void put_u32(uint32_t val);
+    void put_u64(uint64_t val);
+    void put_f64(double val);
+    void put_str(const std::string &str);
+    void put_type(Type *ty);
+    void put_code(const std::vector<IRInstr> &code);
+    void collect_type(Type *ty);
+    void collect_code(const std::vector<IRInstr> &code);
+
+  public:
+    void write(IR &ir, const std::string &path);
+};
+
+class IRReader {
+  private:
+    const char *data;
+    size_t size;
+    size_t pos;
+    std::vector<Type *> types;
+
+    uint32_t get_u32();
+    uint64_t get_u64();
+    double get_f64();
+    std::string get_str();
+    Type *get_type();
+    std::vector<IRInstr> get_code();
+
+  public:
+    IRReader();
+    ~IRReader();
+    void read(const std::string &path, IR &ir);
+};
+
+bool is_otc_file(const std::string &path);
@@ -71,12 +71,23 @@ Type *Parser::get_type_from_string(std::string ty) {
     return type;
 }
 
+// A type name followed by any number of `*`, e.g. `int**`.
+Type *Parser::type_name() {
+    Type *type = get_type_from_string(expect(TK_IDENT).to_str());
+    while (match(TK_ASTERISK)) {
+        eat();
+        Type *ptr = new Type(TY_PTR);
+        ptr->ptr_to = type;
+        type = ptr;
+    }
+    return type;
+}
+
 std::pair<std::string, Type *> Parser::type_specifier() {
     expect(TK_LPAREN);
     Token tk = expect(TK_IDENT);
     expect(TK_COLON);
-    Token type_id = expect(TK_IDENT);
-    Type *type = get_type_from_string(type_id.to_str());
+    Type *type = type_name();
     expect(TK_RPAREN);
     return std::make_pair(tk.to_str(), type);
 }
@@ -435,9 +446,16 @@ Node *Parser::let_fun(std::string name) {
     return let;
 }
 
+// let extern [nogc] name (arg : type)... : type
+// `nogc` declares that the function never allocates or collects.
 Node *Parser::let_extern() {
     expect(TK_EXTERN);
     Token id = expect(TK_IDENT);
+    bool no_gc = false;
+    if (id.to_str() == "nogc" && match(TK_IDENT)) {
+        no_gc = true;
+        id = expect(TK_IDENT);
+    }
     std::vector<std::string> args;
     std::vector<Type *> types;
     while (match(TK_LPAREN)) {
@@ -446,14 +464,14 @@ Node *Parser::let_extern() {
         types.push_back(name_and_type.second);
     }
     expect(TK_COLON);
-    Token tk = expect(TK_IDENT);
-    Type *ret_type = get_type_from_string(tk.to_str());
+    Type *ret_type = type_name();
 
     Node *node = new Node(ND_LET_EXTERN);
     node->let_extern.name = id.to_str();
     node->let_extern.args = args;
     node->let_extern.arg_types = types;
     node->let_extern.ret_type = ret_type;
+    node->let_extern.no_gc = no_gc;
     return node;
 }
 
@@ -493,7 +511,7 @@ Node *Parser::compound() {
 
 Node *Parser::new_expr() {
     expect(TK_NEW);
-    Type *ty = get_type_from_string(expect(TK_IDENT).to_str());
+    Type *ty = type_name();
     Type *ptr = new Type(TY_PTR);
     ptr->ptr_to = ty;
     Node *node = new Node(ND_NEW);
@@ -152,6 +152,7 @@ struct Node {
             std::vector<std::string> args;
             std::vector<Type *> arg_types;
             Type *ret_type;
+            bool no_gc;
         } let_extern;
         struct {
             std::vector<Node *> exprs;
@@ -199,7 +200,8 @@ struct Node {
             let_fun.body->print_node();
             std::cout << ")";
         } else if (type == ND_LET_EXTERN) {
-            std::cout << "(let_extern " << let_extern.name << " ";
+            std::cout << "(let_extern " << (let_extern.no_gc ? "nogc " : "")
+                      << let_extern.name << " ";
             for (std::string name : let_extern.args) {
                 std::cout << name << " ";
             }
@@ -257,6 +259,7 @@ class Parser {
   public:
     Parser(std::vector<Token> tokens);
     Type *get_type_from_string(std::string ty);
+    Type *type_name();
     std::pair<std::string, Type *> type_specifier();
     std::pair<std::string, Type *> argument();
     Node *primary_expr();
@@ -0,0 +1,21 @@
+#pragma once
+
+// CPU features a multiversioned function can be dispatched on (otus
+// -mversion), shared by Codegen and the runtime's otus_cpu_supports. The
+// names are both LLVM's and __builtin_cpu_supports'.
+#define OTUS_CPU_FEATURES(X)                                                   \
+    X("popcnt")                                                                \
+    X("sse3")                                                                  \
+    X("ssse3")                                                                 \
+    X("sse4.1")                                                                \
+    X("sse4.2")                                                                \
+    X("avx")                                                                   \
+    X("avx2")                                                                  \
+    X("fma")                                                                   \
+    X("bmi")                                                                   \
+    X("bmi2")                                                                  \
+    X("avx512f")                                                               \
+    X("avx512cd")                                                              \
+    X("avx512bw")                                                              \
+    X("avx512dq")                                                              \
+    X("avx512vl")
@@ -1,82 +1,1205 @@
 #include "runtime.hpp"
 
+#include "cpu.hpp"
+#include "gc.hpp"
 #include "shadow_stack.hpp"
+#include "stack_map.hpp"
 
-struct Obj {
-    void *ptr;
-    bool marked;
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <utility>
+
+const size_t size_classes[] = {
+    16,  32,  48,   64,   96,   128,  192,  256,  384,
+    512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192,
+};
+const size_t NUM_SIZE_CLASSES = sizeof(size_classes) / sizeof(size_t);
+// size_class of a page holding a single large object.
+const uint32_t GC_LARGE = NUM_SIZE_CLASSES;
+
+static size_t align_up(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+// Offset of the first object in a page.
+static size_t page_header_size() {
+    return align_up(sizeof(PageHeader), GC_MIN_OBJECT);
+}
+
+static size_t os_page_size() {
+    static size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// Map `size` bytes aligned to GC_PAGE_SIZE. `size` must be a multiple of
+// the OS page size.
+static char *map_pages(size_t size) {
+    size_t len = size + GC_PAGE_SIZE;
+    char *raw = (char *)mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return nullptr;
+    }
+    char *base = (char *)align_up((uintptr_t)raw, GC_PAGE_SIZE);
+    if (base != raw) {
+        munmap(raw, base - raw);
+    }
+    munmap(base + size, (raw + len) - (base + size));
+    return base;
+}
+
+static inline uint64_t *header_of(void *obj) { return (uint64_t *)obj - 1; }
+
+static inline const TypeDescriptor *type_of(void *obj) {
+    return (const TypeDescriptor *)*header_of(obj);
+}
+
+// Call `visit` with the address of every pointer field of `obj`.
+template <typename F> static void trace_fields(void *obj, F visit) {
+    void **fields = (void **)obj;
+    for (uint64_t bits = type_of(obj)->pointers; bits != 0; bits &= bits - 1) {
+        visit(&fields[__builtin_ctzll(bits)]);
+    }
+}
+
+// The old generation.
+static class Heap {
+  private:
+    // Every page, for pointer validation and the sweep walk.
+    std::unordered_set<PageHeader *> pages;
+    // The large-object space: pages holding a single object above the
+    // largest size class, swept apart from the others.
+    std::vector<PageHeader *> large_pages;
+    // Empty pages ready to be reused by any size class, still backed by
+    // memory.
+    std::vector<PageHeader *> free_pages;
+    // Empty pages whose memory was returned with MADV_DONTNEED. Reusing
+    // one faults in zeroed memory.
+    std::vector<PageHeader *> decommitted_pages;
+    // Pages of each size class that still have free cells, kept apart for
+    // objects with and without pointers.
+    std::vector<PageHeader *> partial[2][NUM_SIZE_CLASSES];
+    // Pages marked by the last collection but not swept yet. The allocator
+    // sweeps them one at a time as it runs out of free cells, so the
+    // collection pause only covers marking.
+    std::vector<PageHeader *> unswept[2][NUM_SIZE_CLASSES];
+
+    // Return the memory of one free page to the system.
+    void decommit_page() {
+        PageHeader *page = free_pages.back();
+        free_pages.pop_back();
+        madvise(page, GC_PAGE_SIZE, MADV_DONTNEED);
+        decommitted_pages.push_back(page);
+        committed -= GC_PAGE_SIZE;
+    }
+
+    // Whether `size` more bytes can be committed without going over
+    // OTUS_HEAP_MAX, decommitting free pages to make room if needed.
+    bool reserve(size_t size) {
+        while (committed + size > max_committed && !free_pages.empty()) {
+            decommit_page();
+        }
+        return committed + size <= max_committed;
+    }
+
+    PageHeader *new_page(uint32_t size_class, size_t object_size,
+                         size_t mapped, bool scan) {
+        PageHeader *page;
+        if (size_class != GC_LARGE && !free_pages.empty()) {
+            page = free_pages.back();
+            free_pages.pop_back();
+        } else if (!reserve(mapped)) {
+            return nullptr;
+        } else if (size_class != GC_LARGE && !decommitted_pages.empty()) {
+            page = decommitted_pages.back();
+            decommitted_pages.pop_back();
+            committed += mapped;
+        } else {
+            page = (PageHeader *)map_pages(mapped);
+            if (page == nullptr) {
+                return nullptr;
+            }
+            committed += mapped;
+            pages.insert(page);
+            if (size_class == GC_LARGE) {
+                large_pages.push_back(page);
+            }
+        }
+        std::memset(page, 0, sizeof(PageHeader));
+        page->magic = GC_PAGE_MAGIC;
+        page->size_class = size_class;
+        page->scan = scan;
+        page->object_size = object_size;
+        page->mapped = mapped;
+        page->objects = (char *)page + page_header_size();
+        page->num_objects = ((char *)page + mapped - page->objects) /
+                            object_size;
+        if (size_class != GC_LARGE) {
+            build_free_list(page);
+        }
+        if (scan) {
+            page->scan_index = scan_pages.size();
+            scan_pages.push_back(page);
+        }
+        return page;
+    }
+
+    // Thread every unallocated cell of `page` into its free list, in
+    // address order.
+    void build_free_list(PageHeader *page) {
+        FreeCell **tail = &page->free_list;
+        for (size_t i = 0; i < page->num_objects; i++) {
+            if (!page->test(page->alloc_bits, i)) {
+                FreeCell *cell =
+                    (FreeCell *)(page->objects + i * page->object_size);
+                *tail = cell;
+                tail = &cell->next;
+            }
+        }
+        *tail = nullptr;
+    }
+
+    void *alloc_small(uint32_t size_class, bool scan) {
+        std::vector<PageHeader *> &list = partial[scan][size_class];
+        while (!list.empty() && list.back()->free_list == nullptr) {
+            list.pop_back();
+        }
+        std::vector<PageHeader *> &pending = unswept[scan][size_class];
+        while (list.empty() && !pending.empty() && !defer_sweep) {
+            PageHeader *page = pending.back();
+            pending.pop_back();
+            sweep_page(page);
+        }
+        if (list.empty()) {
+            PageHeader *page = new_page(size_class, size_classes[size_class],
+                                        GC_PAGE_SIZE, scan);
+            if (page == nullptr) {
+                return nullptr;
+            }
+            list.push_back(page);
+        }
+        PageHeader *page = list.back();
+        FreeCell *cell = page->free_list;
+        page->free_list = cell->next;
+        page->set(page->alloc_bits, page->index_of(cell));
+        page->live++;
+        return cell;
+    }
+
+    void *alloc_large(size_t size, bool scan) {
+        size_t mapped = align_up(page_header_size() + size, os_page_size());
+        PageHeader *page = new_page(GC_LARGE, size, mapped, scan);
+        if (page == nullptr) {
+            return nullptr;
+        }
+        page->num_objects = 1;
+        page->set(page->alloc_bits, 0);
+        page->live = 1;
+        return page->objects;
+    }
+
+    // Large objects are unmapped right away. Other pages are kept for
+    // reuse, but only as many as the heap can grow into before the next
+    // collection stay backed by memory.
+    void release_page(PageHeader *page) {
+        page->magic = 0;
+        if (page->scan) {
+            PageHeader *last = scan_pages.back();
+            scan_pages[page->scan_index] = last;
+            last->scan_index = page->scan_index;
+            scan_pages.pop_back();
+        }
+        if (page->size_class == GC_LARGE) {
+            pages.erase(page);
+            committed -= page->mapped;
+            munmap(page, page->mapped);
+            return;
+        }
+        free_pages.push_back(page);
+        if (free_pages.size() * GC_PAGE_SIZE > retain) {
+            decommit_page();
+        }
+    }
+
+  public:
+    // Bytes taken by allocated objects, counted in whole cells.
+    size_t bytes;
+    // Bytes of pages backed by memory, used or free, and their cap.
+    size_t committed;
+    size_t max_committed;
+    // Bytes of free pages to keep backed by memory.
+    size_t retain;
+    // Pages of objects holding pointers, whose cards minor collections
+    // scan.
+    std::vector<PageHeader *> scan_pages;
+    // Set while scan_cards walks scan_pages. Sweeping a page that turns
+    // out empty would release it and reorder the list, so allocation
+    // takes new pages over unswept ones meanwhile.
+    bool defer_sweep;
+
+    Heap()
+        : bytes{0}, committed{0}, max_committed{SIZE_MAX}, retain{0},
+          defer_sweep{false} {}
+
+    // Returns a zeroed object of `type` with its header set, or nullptr if
+    // the system is out of memory. Objects with pointers are kept on pages
+    // of their own.
+    void *alloc(const TypeDescriptor *type) {
+        size_t size = GC_HEADER_SIZE + type->size;
+        bool scan = type->pointers != 0;
+        char *cell;
+        size_t cell_size = size;
+        if (size > size_classes[NUM_SIZE_CLASSES - 1]) {
+            cell = (char *)alloc_large(size, scan);
+        } else {
+            uint32_t size_class = 0;
+            while (size_classes[size_class] < size) {
+                size_class++;
+            }
+            cell = (char *)alloc_small(size_class, scan);
+            cell_size = size_classes[size_class];
+        }
+        if (cell == nullptr) {
+            return nullptr;
+        }
+        std::memset(cell, 0, cell_size);
+        bytes += cell_size;
+        *(uint64_t *)cell = (uint64_t)type;
+        return cell + GC_HEADER_SIZE;
+    }
+
+    // The page of the heap object `ptr`, or nullptr if `ptr` is not one.
+    PageHeader *find(void *ptr, size_t *index) {
+        char *cell = (char *)ptr - GC_HEADER_SIZE;
+        PageHeader *page =
+            (PageHeader *)((uintptr_t)cell & ~(uintptr_t)(GC_PAGE_SIZE - 1));
+        if (!pages.count(page) || page->magic != GC_PAGE_MAGIC ||
+            cell < page->objects) {
+            return nullptr;
+        }
+        size_t i = page->index_of(cell);
+        if (i >= page->num_objects ||
+            page->objects + i * page->object_size != cell ||
+            !page->test(page->alloc_bits, i)) {
+            return nullptr;
+        }
+        *index = i;
+        return page;
+    }
+
+    // Mark the object `ptr`. Returns false if it is not a heap
+    // object or was already marked.
+    bool mark(void *ptr) {
+        size_t i;
+        PageHeader *page = find(ptr, &i);
+        if (page == nullptr || page->test(page->mark_bits, i)) {
+            return false;
+        }
+        page->set(page->mark_bits, i);
+        return true;
+    }
+
+    // Like mark, but safe to call from several marker threads at once.
+    bool mark_atomic(void *ptr) {
+        size_t i;
+        PageHeader *page = find(ptr, &i);
+        return page != nullptr && page->test_and_set(page->mark_bits, i);
+    }
+
+    // Free the unmarked objects of `page` and clear its marks. The page is
+    // released if nothing on it survived, or else offered to the allocator
+    // if it has free cells.
+    void sweep_page(PageHeader *page) {
+        size_t live = 0;
+        for (size_t w = 0; w < GC_BITMAP_WORDS; w++) {
+            page->alloc_bits[w] &= page->mark_bits[w];
+            page->mark_bits[w] = 0;
+            live += __builtin_popcountll(page->alloc_bits[w]);
+        }
+        page->live = live;
+        if (live == 0) {
+            release_page(page);
+        } else if (page->size_class != GC_LARGE) {
+            build_free_list(page);
+            if (page->free_list != nullptr) {
+                partial[page->scan][page->size_class].push_back(page);
+            }
+        }
+    }
+
+    // Queue every page for sweeping after a mark. The marked bytes are
+    // counted up front from the mark bitmaps. Large objects are swept
+    // right away so their memory is returned at once.
+    void start_sweep() {
+        bytes = 0;
+        for (size_t c = 0; c < NUM_SIZE_CLASSES; c++) {
+            partial[false][c].clear();
+            partial[true][c].clear();
+        }
+        for (auto page : pages) {
+            if (page->magic != GC_PAGE_MAGIC ||
+                page->size_class == GC_LARGE) {
+                continue;
+            }
+            size_t live = 0;
+            for (size_t w = 0; w < GC_BITMAP_WORDS; w++) {
+                live += __builtin_popcountll(page->mark_bits[w]);
+            }
+            bytes += live * page->object_size;
+            unswept[page->scan][page->size_class].push_back(page);
+        }
+        size_t kept = 0;
+        for (auto page : large_pages) {
+            if (page->test(page->mark_bits, 0)) {
+                bytes += page->object_size;
+                large_pages[kept++] = page;
+            }
+            sweep_page(page);
+        }
+        large_pages.resize(kept);
+    }
+
+    // Sweep the pages still queued, which the next mark needs.
+    void finish_sweep() {
+        for (size_t c = 0; c < NUM_SIZE_CLASSES; c++) {
+            for (int scan = 0; scan < 2; scan++) {
+                for (auto page : unswept[scan][c]) {
+                    sweep_page(page);
+                }
+                unswept[scan][c].clear();
+            }
+        }
+    }
+} heap;
+
+thread_local Nursery otus_nursery;
+bool otus_gc_marking = false;
+
+static inline bool in_nursery(void *ptr) {
+    return (char *)ptr >= otus_nursery.start && (char *)ptr < otus_nursery.end;
+}
+
+// The heap may grow to OTUS_GC_GROWTH times the bytes live after the last
+// collection, but never triggers a collection below OTUS_GC_MIN_HEAP.
+const double GC_DEFAULT_GROWTH = 2.0;
+const size_t GC_DEFAULT_MIN_HEAP = 4 * 1024 * 1024;
+// Size of each thread's nursery, set by OTUS_GC_NURSERY.
+const size_t GC_DEFAULT_NURSERY = 1024 * 1024;
+// Incremental marking checks its deadline once per this many objects.
+const size_t GC_SLICE_CHECK = 256;
+
+// Parse a byte count such as "512K", "64M" or "1G".
+static size_t parse_size(const char *str, size_t fallback) {
+    char *end;
+    unsigned long long n = std::strtoull(str, &end, 10);
+    if (end == str) {
+        return fallback;
+    }
+    switch (*end) {
+    case 'g':
+    case 'G':
+        n *= 1024;
+        // fall through
+    case 'm':
+    case 'M':
+        n *= 1024;
+        // fall through
+    case 'k':
+    case 'K':
+        n *= 1024;
+    }
+    return n;
+}
+
+// A marker shares part of its stack once it holds more than this many
+// objects and its deque has run dry.
+const size_t GC_MARK_SHARE = 64;
+
+struct MarkWorker {
+    // Objects to trace, private to the marker.
+    std::vector<void *> local;
+    // Objects offered to other markers.
+    std::mutex lock;
+    std::deque<void *> shared;
+    std::atomic<size_t> shared_size;
+
+    MarkWorker() : shared_size{0} {}
 };
 
+// The parallel marker, used when OTUS_GC_THREADS is above 1. The thread
+// running the collection is marker 0; the others are started on first
+// use and sleep between collections. Each marker traces from its own
+// stack and steals from the other markers' deques when it runs out.
+static class Markers {
+  private:
+    std::vector<std::unique_ptr<MarkWorker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    // Bumped for every mark so sleeping markers know to start.
+    size_t epoch;
+    size_t finished;
+    bool stopping;
+    // Markers out of work. Marking is over once all of them are.
+    std::atomic<size_t> idle;
+
+    void share(MarkWorker &w) {
+        std::lock_guard<std::mutex> guard(w.lock);
+        size_t half = w.local.size() / 2;
+        w.shared.insert(w.shared.end(), w.local.begin(),
+                        w.local.begin() + half);
+        w.local.erase(w.local.begin(), w.local.begin() + half);
+        w.shared_size = w.shared.size();
+    }
+
+    // Take an object from the front of some marker's deque, trying our
+    // own first.
+    bool steal(size_t self, void **obj) {
+        for (size_t n = 0; n < workers.size(); n++) {
+            MarkWorker &victim = *workers[(self + n) % workers.size()];
+            if (victim.shared_size == 0) {
+                continue;
+            }
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.shared.empty()) {
+                *obj = victim.shared.front();
+                victim.shared.pop_front();
+                victim.shared_size = victim.shared.size();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool any_shared() {
+        for (auto &w : workers) {
+            if (w->shared_size != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void drain(size_t self) {
+        MarkWorker &w = *workers[self];
+        for (;;) {
+            while (!w.local.empty()) {
+                void *obj = w.local.back();
+                w.local.pop_back();
+                trace_fields(obj, [&](void **field) {
+                    if (*field != nullptr && heap.mark_atomic(*field) &&
+                        type_of(*field)->pointers != 0) {
+                        w.local.push_back(*field);
+                    }
+                });
+                if (w.local.size() > GC_MARK_SHARE && w.shared_size == 0) {
+                    share(w);
+                }
+            }
+            void *obj;
+            if (steal(self, &obj)) {
+                w.local.push_back(obj);
+                continue;
+            }
+            idle++;
+            for (;;) {
+                if (idle == workers.size()) {
+                    return;
+                }
+                if (any_shared()) {
+                    idle--;
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void run(size_t self) {
+        size_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                start_cv.wait(guard, [&] { return stopping || epoch != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = epoch;
+            }
+            drain(self);
+            std::lock_guard<std::mutex> guard(lock);
+            finished++;
+            done_cv.notify_one();
+        }
+    }
+
+  public:
+    Markers() : epoch{0}, finished{0}, stopping{false}, idle{0} {}
+
+    ~Markers() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        start_cv.notify_all();
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    void set_threads(size_t n) {
+        for (size_t i = workers.size(); i < n; i++) {
+            workers.push_back(std::unique_ptr<MarkWorker>(new MarkWorker()));
+        }
+    }
+
+    size_t size() { return workers.size(); }
+
+    // Trace from `gray`, whose objects are already marked, on every
+    // marker.
+    void mark(std::vector<void *> &gray) {
+        if (threads.empty()) {
+            for (size_t i = 1; i < workers.size(); i++) {
+                threads.push_back(std::thread(&Markers::run, this, i));
+            }
+        }
+        for (size_t i = 0; i < gray.size(); i++) {
+            workers[i % workers.size()]->local.push_back(gray[i]);
+        }
+        gray.clear();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            idle = 0;
+            finished = 0;
+            epoch++;
+        }
+        start_cv.notify_all();
+        drain(0);
+        std::unique_lock<std::mutex> guard(lock);
+        done_cv.wait(guard, [&] { return finished == threads.size(); });
+    }
+} markers;
+
+typedef std::chrono::steady_clock Clock;
+
 static class GC {
-private:
-    std::map<void *, Obj *> heap;
-public:
-    void mark_phase() {
+  private:
+    double growth;
+    size_t min_heap;
+    size_t nursery_size;
+    // Heap size at which the next collection starts.
+    size_t limit;
+    // Promoted objects whose fields still have to be scanned.
+    std::vector<void *> promoted;
+    // Marked objects whose fields still have to be marked.
+    std::vector<void *> gray;
+    // With OTUS_GC_PAUSE_US set, major collections mark incrementally in
+    // slices of at most this many microseconds. 0 collects in one pause.
+    long pause_us;
+    int pause_depth;
+    Clock::time_point pause_start;
+    OtusGCStats stats;
+    // Whether to print the statistics at exit, set by OTUS_GC_STATS.
+    bool print_stats;
+    // Trace events for OTUS_GC_TRACE, in the Chrome trace event format.
+    FILE *trace_file;
+    Clock::time_point trace_origin;
+    bool trace_empty;
+
+    // Times a phase of the collector. The time the mutator is stopped for
+    // is that of the outermost phase.
+    class Pause {
+      private:
+        GC &gc;
+        const char *name;
+        Clock::time_point start;
+
+      public:
+        Pause(GC &gc, const char *name)
+            : gc(gc), name{name}, start{Clock::now()} {
+            if (gc.pause_depth++ == 0) {
+                gc.pause_start = start;
+            }
+        }
+        ~Pause() {
+            std::chrono::duration<double, std::micro> us =
+                Clock::now() - start;
+            gc.trace(name, start, us.count());
+            if (--gc.pause_depth == 0) {
+                gc.record_pause(us.count());
+            }
+        }
+    };
+
+    void record_pause(double us) {
+        int bucket = 0;
+        while (bucket < OTUS_GC_PAUSE_BUCKETS - 1 &&
+               us >= (double)((uint64_t)1 << bucket)) {
+            bucket++;
+        }
+        stats.pause_histogram[bucket]++;
+        stats.pauses++;
+        stats.pause_total_us += us;
+        stats.pause_max_us = std::max(stats.pause_max_us, us);
+    }
+
+    void trace(const char *name, Clock::time_point start, double us) {
+        if (trace_file == nullptr) {
+            return;
+        }
+        std::chrono::duration<double, std::micro> ts = start - trace_origin;
+        std::fprintf(trace_file,
+                     "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                     "\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"heap_bytes\":%zu}}",
+                     trace_empty ? "" : ",", name, ts.count(), us, heap.bytes);
+        trace_empty = false;
+    }
+
+    // Count the objects allocated in the nursery since it was last
+    // emptied. The compiled fast path does not count them itself, and
+    // walking them would make minor collections cost time per allocation
+    // rather than per survivor, so they are only counted when statistics
+    // are printed or traced; see OtusGCStats. Otherwise only the space
+    // they took is added.
+    void count_nursery(uint64_t *objects, uint64_t *bytes) {
+        if (otus_nursery.start == nullptr) {
+            return;
+        }
+        if (!print_stats && trace_file == nullptr) {
+            // Whole pages before the current one, unused ends included.
+            char *page = otus_nursery.limit - GC_PAGE_SIZE;
+            *bytes += (page - otus_nursery.start) / GC_PAGE_SIZE *
+                          (GC_PAGE_SIZE - page_header_size()) +
+                      (otus_nursery.cursor - page - page_header_size());
+            return;
+        }
+        for (char *p = otus_nursery.start; p < otus_nursery.cursor;
+             p += GC_PAGE_SIZE) {
+            char *obj = p + page_header_size();
+            char *used_end = std::min(otus_nursery.cursor, p + GC_PAGE_SIZE);
+            // The rest of a page is zero once an object did not fit.
+            while (obj < used_end && *(uint64_t *)obj != 0) {
+                uint64_t header = *(uint64_t *)obj;
+                const TypeDescriptor *type =
+                    (header & GC_FORWARDED)
+                        ? type_of((void *)(header & ~GC_FORWARDED))
+                        : (const TypeDescriptor *)header;
+                (*objects)++;
+                *bytes += type->size;
+                obj += GC_HEADER_SIZE + align_up(type->size, sizeof(uint64_t));
+            }
+        }
+    }
+
+    // With OTUS_HEAP_MAX set, collections start early enough to leave
+    // room below the cap for promoting a full nursery.
+    void update_limit() {
+        limit = std::max(min_heap, (size_t)(heap.bytes * growth));
+        if (heap.max_committed != SIZE_MAX) {
+            limit = std::min(limit, heap.max_committed -
+                                        std::min(heap.max_committed,
+                                                 nursery_size));
+        }
+        heap.retain = limit - std::min(limit, heap.bytes);
+    }
+
+    void init_nursery() {
+        otus_nursery.start = map_pages(nursery_size);
+        if (otus_nursery.start == nullptr) {
+            std::cerr << "memory exhausted" << std::endl;
+            std::exit(1);
+        }
+        otus_nursery.end = otus_nursery.start + nursery_size;
+        for (char *p = otus_nursery.start; p < otus_nursery.end;
+             p += GC_PAGE_SIZE) {
+            ((PageHeader *)p)->magic = GC_NURSERY_MAGIC;
+        }
+        otus_nursery.cursor = otus_nursery.start + page_header_size();
+        otus_nursery.limit = otus_nursery.start + GC_PAGE_SIZE;
+    }
+
+    // Copy the nursery object `obj` to the old generation, leaving a
+    // forwarding address behind, and return its new address.
+    void *promote(void *obj) {
+        uint64_t header = *header_of(obj);
+        if (header & GC_FORWARDED) {
+            return (void *)(header & ~GC_FORWARDED);
+        }
+        const TypeDescriptor *type = (const TypeDescriptor *)header;
+        void *copy = heap.alloc(type);
+        if (copy == nullptr) {
+            std::cerr << "memory exhausted" << std::endl;
+            std::exit(1);
+        }
+        std::memcpy(copy, obj, type->size);
+        *header_of(obj) = (uint64_t)copy | GC_FORWARDED;
+        stats.promoted_bytes += type->size;
+        // Objects promoted while marking are live; they are marked and,
+        // like any other marked object, traced.
+        if (otus_gc_marking) {
+            heap.mark(copy);
+        }
+        if (type->pointers != 0) {
+            promoted.push_back(copy);
+            if (otus_gc_marking) {
+                gray.push_back(copy);
+            }
+        }
+        return copy;
+    }
+
+    void promote_fields(void *obj) {
+        trace_fields(obj, [&](void **field) {
+            if (in_nursery(*field)) {
+                *field = promote(*field);
+            }
+        });
+    }
+
+    // Old objects on a dirty card may point into the nursery. Promoting
+    // may add pages to scan_pages; those hold nothing but promoted
+    // objects, which minor_collect traces from `promoted`, so only the
+    // pages there before the scan are walked.
+    void scan_cards() {
+        heap.defer_sweep = true;
+        size_t num_pages = heap.scan_pages.size();
+        for (size_t p = 0; p < num_pages; p++) {
+            PageHeader *page = heap.scan_pages[p];
+            char *base = (char *)page;
+            size_t size = page->object_size;
+            for (size_t c = 0; c < GC_CARDS; c++) {
+                if (!page->cards[c]) {
+                    continue;
+                }
+                page->cards[c] = 0;
+                char *lo = base + (c << GC_CARD_SHIFT);
+                char *hi = lo + ((size_t)1 << GC_CARD_SHIFT);
+                if (hi <= page->objects) {
+                    continue;
+                }
+                // The barrier dirties the card of the object, which lies
+                // one header past the start of its cell.
+                char *first = lo - GC_HEADER_SIZE;
+                size_t i = 0;
+                if (first > page->objects) {
+                    i = (first - page->objects + size - 1) / size;
+                }
+                for (; i < page->num_objects; i++) {
+                    char *obj = page->objects + i * size + GC_HEADER_SIZE;
+                    if (obj >= hi) {
+                        break;
+                    }
+                    if (page->test(page->alloc_bits, i)) {
+                        promote_fields(obj);
+                    }
+                }
+            }
+        }
+        heap.defer_sweep = false;
+    }
+
+    // Mark the objects the roots point to. A root's metadata is the
+    // descriptor of the objects it points to, which spares reading the
+    // headers of pointer-free objects.
+    void mark_roots() {
         auto f = [&](void **Root, const void *Meta) {
-            Obj *obj = heap[*Root];
-            if (obj == nullptr) return;
-            if (obj->marked == false) {
-                std::cout << "marked: " << obj->ptr << std::endl;
-                obj->marked = true;
+            const TypeDescriptor *type = (const TypeDescriptor *)Meta;
+            if (*Root != nullptr && heap.mark(*Root)) {
+                if (type == nullptr || type->pointers != 0) {
+                    gray.push_back(*Root);
+                }
             }
         };
         visitGCRoots(f);
+        stack_maps().visit_roots(f);
     }
 
-    void sweep_phase() {
-        for (auto it = heap.begin(); it != heap.end(); it++) {
-            Obj *obj = (*it).second;
-            if (obj == nullptr) continue;
-            std::cout << "sweep: " << obj->ptr << std::endl;
-            if (obj->marked == false) {
-                free(obj);
-            } else {
-                obj->marked = false;
+    // Trace gray objects until there are none left or, if `deadline` is
+    // given, until it passes. Returns whether marking is complete.
+    bool drain_gray(const Clock::time_point *deadline) {
+        size_t traced = 0;
+        while (!gray.empty()) {
+            if (deadline != nullptr && ++traced % GC_SLICE_CHECK == 0 &&
+                Clock::now() >= *deadline) {
+                return false;
             }
+            void *obj = gray.back();
+            gray.pop_back();
+            trace_fields(obj, [&](void **field) {
+                if (*field != nullptr && heap.mark(*field) &&
+                    type_of(*field)->pointers != 0) {
+                    gray.push_back(*field);
+                }
+            });
         }
+        return true;
     }
 
-    void collect() {
-        mark_phase();
+    // An incremental collection marks in slices between allocations.
+    // Stores made meanwhile go through otus_gc_shade, so the only
+    // references the marker can miss are on the stack, which is scanned
+    // again when marking finishes.
+    void start_marking() {
+        Pause pause(*this, "mark-start");
+        minor_collect();
+        heap.finish_sweep();
+        mark_roots();
+        otus_gc_marking = true;
+    }
+
+    void finish_marking() {
+        Pause pause(*this, "mark-finish");
+        minor_collect();
+        mark_roots();
+        drain_gray(nullptr);
+        otus_gc_marking = false;
         sweep_phase();
+        stats.major_collections++;
+        stats.live_bytes = heap.bytes;
+        update_limit();
     }
 
-    void *alloc(size_t size) {
-        collect();
-        void *ptr = std::malloc(size);
-        if (ptr == NULL) {
+    // Mark until the current pause has used up its budget. Marking is
+    // finished in one go once nothing is left to trace, or when the heap
+    // grows well past its limit because the mutator outpaces the marker.
+    void mark_slice() {
+        Pause pause(*this, "mark-slice");
+        if (gray.empty() || heap.bytes > 2 * limit) {
+            finish_marking();
+            return;
+        }
+        Clock::time_point deadline =
+            pause_start + std::chrono::microseconds(pause_us);
+        drain_gray(&deadline);
+    }
+
+    // The heap has outgrown its limit.
+    void trigger() {
+        if (pause_us == 0) {
             collect();
-            ptr = std::malloc(size);
-            if (ptr == NULL) {
-                std::cerr << "memory exhausted" << std::endl;
-                std::exit(1);
+        } else if (!otus_gc_marking) {
+            start_marking();
+        }
+    }
+
+    // The upper bound of the histogram bucket holding the `p` quantile of
+    // the pauses, or the longest pause if that is shorter.
+    double pause_quantile(const OtusGCStats &s, double p) {
+        uint64_t rank = (uint64_t)(p * s.pauses);
+        uint64_t seen = 0;
+        for (int i = 0; i < OTUS_GC_PAUSE_BUCKETS - 1; i++) {
+            seen += s.pause_histogram[i];
+            if (seen > rank) {
+                return std::min((double)((uint64_t)1 << i), s.pause_max_us);
             }
         }
+        return s.pause_max_us;
+    }
 
-        std::cout << "allocated: " << ptr << std::endl;
+    void report_pauses(const OtusGCStats &s) {
+        if (s.pauses == 0) {
+            return;
+        }
+        std::cerr << "gc: " << s.pauses << " pauses, " << s.pause_total_us
+                  << "us in total, p50 <= " << pause_quantile(s, 0.5)
+                  << "us, p90 <= " << pause_quantile(s, 0.9) << "us, p99 <= "
+                  << pause_quantile(s, 0.99) << "us, max " << s.pause_max_us
+                  << "us" << std::endl;
+    }
 
-        Obj *obj = new Obj;
-        obj->ptr = ptr;
-        obj->marked = false;
-        heap[ptr] = obj;
+    void report_stats() {
+        OtusGCStats s;
+        snapshot(&s);
+        std::cerr << "gc: " << s.allocations << " objects allocated ("
+                  << s.allocated_bytes << " bytes), " << s.promoted_bytes
+                  << " bytes promoted" << std::endl;
+        std::cerr << "gc: " << s.minor_collections << " minor and "
+                  << s.major_collections << " major collections, "
+                  << s.live_bytes << " bytes live after the last, "
+                  << s.heap_bytes << " bytes in use, " << s.committed_bytes
+                  << " committed" << std::endl;
+        report_pauses(s);
+        for (int i = 0; i < OTUS_GC_PAUSE_BUCKETS; i++) {
+            if (s.pause_histogram[i] != 0) {
+                std::cerr << "gc:   < " << ((uint64_t)1 << i)
+                          << "us: " << s.pause_histogram[i] << std::endl;
+            }
+        }
+    }
 
+  public:
+    GC()
+        : growth{GC_DEFAULT_GROWTH}, min_heap{GC_DEFAULT_MIN_HEAP},
+          nursery_size{GC_DEFAULT_NURSERY}, pause_us{0}, pause_depth{0},
+          stats(), print_stats{false}, trace_file{nullptr},
+          trace_empty{true} {
+        if (const char *env = std::getenv("OTUS_GC_GROWTH")) {
+            double val = std::atof(env);
+            if (val > 1.0) {
+                growth = val;
+            }
+        }
+        if (const char *env = std::getenv("OTUS_GC_MIN_HEAP")) {
+            min_heap = parse_size(env, GC_DEFAULT_MIN_HEAP);
+        }
+        if (const char *env = std::getenv("OTUS_GC_NURSERY")) {
+            nursery_size = parse_size(env, GC_DEFAULT_NURSERY);
+        }
+        if (const char *env = std::getenv("OTUS_HEAP_MAX")) {
+            heap.max_committed = parse_size(env, SIZE_MAX);
+        }
+        if (const char *env = std::getenv("OTUS_GC_THREADS")) {
+            int threads = std::atoi(env);
+            if (threads > 1) {
+                markers.set_threads(threads);
+            }
+        }
+        if (const char *env = std::getenv("OTUS_GC_PAUSE_US")) {
+            pause_us = std::max(0L, std::atol(env));
+        }
+        if (const char *env = std::getenv("OTUS_GC_STATS")) {
+            print_stats = std::atoi(env) != 0;
+        }
+        if (const char *env = std::getenv("OTUS_GC_TRACE")) {
+            trace_file = std::fopen(env, "w");
+            if (trace_file == nullptr) {
+                std::cerr << "cannot open GC trace " << env << std::endl;
+            } else {
+                std::fputs("{\"traceEvents\":[", trace_file);
+                trace_origin = Clock::now();
+            }
+        }
+        nursery_size =
+            align_up(std::max(nursery_size, GC_PAGE_SIZE), GC_PAGE_SIZE);
+        update_limit();
+    }
+
+    // Pause times are also reported at exit in incremental mode, so that
+    // the budget can be checked.
+    ~GC() {
+        if (print_stats) {
+            report_stats();
+        } else if (pause_us != 0) {
+            report_pauses(stats);
+        }
+        if (trace_file != nullptr) {
+            std::fputs("\n]}\n", trace_file);
+            std::fclose(trace_file);
+        }
+    }
+
+    void snapshot(OtusGCStats *s) {
+        *s = stats;
+        count_nursery(&s->allocations, &s->allocated_bytes);
+        s->heap_bytes = heap.bytes;
+        s->committed_bytes = heap.committed;
+    }
+
+    // Promote every nursery object reachable from the roots or from old
+    // objects on dirty cards, then empty the nursery. The work done is
+    // proportional to the survivors, not to the size of either generation.
+    void minor_collect() {
+        if (otus_nursery.start == nullptr) {
+            return;
+        }
+        Pause pause(*this, "minor");
+        auto f = [&](void **Root, const void *) {
+            if (in_nursery(*Root)) {
+                *Root = promote(*Root);
+            }
+        };
+        visitGCRoots(f);
+        stack_maps().visit_roots(f);
+        scan_cards();
+        while (!promoted.empty()) {
+            void *obj = promoted.back();
+            promoted.pop_back();
+            promote_fields(obj);
+        }
+        count_nursery(&stats.allocations, &stats.allocated_bytes);
+        stats.minor_collections++;
+
+        // New objects must start out zeroed.
+        for (char *p = otus_nursery.start; p < otus_nursery.cursor;
+             p += GC_PAGE_SIZE) {
+            char *objects = p + page_header_size();
+            char *used_end = std::min(otus_nursery.cursor, p + GC_PAGE_SIZE);
+            std::memset(objects, 0, used_end - objects);
+        }
+        otus_nursery.cursor = otus_nursery.start + page_header_size();
+        otus_nursery.limit = otus_nursery.start + GC_PAGE_SIZE;
+    }
+
+    // Mark everything reachable from the roots.
+    void mark_phase() {
+        mark_roots();
+        if (markers.size() > 1) {
+            markers.mark(gray);
+            return;
+        }
+        drain_gray(nullptr);
+    }
+
+    // The heap is swept lazily; see Heap::unswept.
+    void sweep_phase() { heap.start_sweep(); }
+
+    // A full collection starts with a minor one so that every live object
+    // is in the old generation. An incremental collection in progress is
+    // finished first.
+    void collect() {
+        Pause pause(*this, "full");
+        if (otus_gc_marking) {
+            finish_marking();
+        }
+        minor_collect();
+        heap.finish_sweep();
+        mark_phase();
+        sweep_phase();
+        stats.major_collections++;
+        stats.live_bytes = heap.bytes;
+        update_limit();
+    }
+
+    // Dijkstra's insertion barrier: an object stored into the heap while
+    // marking is marked, so the marker cannot miss it.
+    void shade(void *obj) {
+        if (obj != nullptr && heap.mark(obj) && type_of(obj)->pointers != 0) {
+            gray.push_back(obj);
+        }
+    }
+
+    void *alloc_old(const TypeDescriptor *type) {
+        if (otus_gc_marking) {
+            mark_slice();
+        } else if (heap.bytes + type->size > limit) {
+            trigger();
+        }
+        void *ptr = heap.alloc(type);
+        if (ptr == NULL) {
+            collect();
+            ptr = heap.alloc(type);
+        }
+        if (ptr == NULL) {
+            std::cerr << "memory exhausted" << std::endl;
+            std::exit(1);
+        }
+        // Objects allocated while marking are live.
+        if (otus_gc_marking) {
+            heap.mark(ptr);
+        }
+        stats.allocations++;
+        stats.allocated_bytes += type->size;
         return ptr;
     }
 
-    void free(Obj *obj) {
-        std::cout << "freed: " << obj->ptr << std::endl;
-        heap[obj->ptr] = nullptr;
-        std::free(obj->ptr);
-        delete obj;
+    void *alloc(const TypeDescriptor *type) {
+        if (type->size > GC_NURSERY_MAX_OBJECT) {
+            return alloc_old(type);
+        }
+        if (otus_nursery.start == nullptr) {
+            init_nursery();
+        }
+        size_t total =
+            GC_HEADER_SIZE + align_up(type->size, sizeof(uint64_t));
+        while (otus_nursery.cursor + total > otus_nursery.limit) {
+            // Incremental marking advances by a slice per nursery page.
+            if (otus_nursery.limit == otus_nursery.end) {
+                Pause pause(*this, "nursery-full");
+                minor_collect();
+                if (otus_gc_marking) {
+                    mark_slice();
+                } else if (heap.bytes > limit) {
+                    trigger();
+                }
+            } else {
+                // Move on to the next page of the nursery.
+                otus_nursery.cursor = otus_nursery.limit + page_header_size();
+                otus_nursery.limit += GC_PAGE_SIZE;
+                if (otus_gc_marking) {
+                    mark_slice();
+                }
+            }
+        }
+        uint64_t *header = (uint64_t *)otus_nursery.cursor;
+        otus_nursery.cursor += total;
+        *header = (uint64_t)type;
+        return header + 1;
     }
 } gc;
 
+// Descriptor of the pointer-free objects allocated through alloc(size).
+static const TypeDescriptor *raw_type(size_t size) {
+    static std::map<size_t, TypeDescriptor> types;
+    TypeDescriptor &type = types[size];
+    type.size = size;
+    return &type;
+}
+
+#if defined(__x86_64__)
+// strcmp may itself be resolved at load time, so it cannot be called
+// before then.
+static bool same_name(const char *a, const char *b) {
+    for (; *a == *b; a++, b++) {
+        if (*a == '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
 extern "C" {
     void *alloc(size_t size) {
-        return gc.alloc(size);
+        return gc.alloc(raw_type(size));
+    }
+
+    void *alloc_typed(const TypeDescriptor *type) {
+        return gc.alloc(type);
     }
 
     void collect() {
         gc.collect();
     }
+
+    void otus_gc_shade(void *obj) {
+        gc.shade(obj);
+    }
+
+    void otus_gc_stats(OtusGCStats *stats) {
+        gc.snapshot(stats);
+    }
+
+    void otus_gc_add_stack_map(const uint8_t *map) {
+        stack_maps().add(map);
+    }
+
+    int otus_cpu_supports(const char *feature) {
+#if defined(__x86_64__)
+        // Resolvers run before the constructors that would initialize the
+        // CPU model.
+        __builtin_cpu_init();
+#define OTUS_CPU_SUPPORTS(name)                                                \
+    if (same_name(feature, name)) {                                            \
+        return __builtin_cpu_supports(name) != 0;                              \
+    }
+        OTUS_CPU_FEATURES(OTUS_CPU_SUPPORTS)
+#undef OTUS_CPU_SUPPORTS
+#endif
+        return 0;
+    }
 }
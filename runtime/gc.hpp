@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Heap layout shared by the collector and by the code Codegen emits for
+// allocation and write barriers.
+
+// The heap is made of GC_PAGE_SIZE pages aligned to their size, so the page
+// header of any object is found by masking its address. Each page holds
+// objects of a single size class; objects too large for any class go to the
+// large-object space, where each gets a mapping of its own that is unmapped
+// as soon as it dies. The nursery is carved from pages too.
+const size_t GC_PAGE_SIZE = 64 * 1024;
+const uint32_t GC_PAGE_MAGIC = 0x6f747573;    // "otus"
+const uint32_t GC_NURSERY_MAGIC = 0x6e757273; // "nurs"
+// Smallest size class; the granule of the mark and allocation bitmaps.
+const size_t GC_MIN_OBJECT = 16;
+const size_t GC_MAX_OBJECTS = GC_PAGE_SIZE / GC_MIN_OBJECT;
+const size_t GC_BITMAP_WORDS = GC_MAX_OBJECTS / 64;
+// A store of a heap pointer into an object dirties the card of the
+// object's address, so minor collections only scan old objects on dirty
+// cards for pointers into the nursery.
+const size_t GC_CARD_SHIFT = 9;
+const size_t GC_CARDS = GC_PAGE_SIZE >> GC_CARD_SHIFT;
+
+struct FreeCell {
+    FreeCell *next;
+};
+
+struct PageHeader {
+    uint32_t magic;
+    uint32_t size_class;
+    // Whether the objects of the page hold heap pointers.
+    bool scan;
+    // Set on the cards of objects a heap pointer was stored into.
+    uint8_t cards[GC_CARDS];
+    size_t object_size;
+    size_t num_objects;
+    // Bytes mapped for the page: GC_PAGE_SIZE unless it holds a large
+    // object.
+    size_t mapped;
+    // Position in Heap::scan_pages, for pages with `scan` set.
+    size_t scan_index;
+    size_t live;
+    // The first cell. A cell is an object together with its header.
+    char *objects;
+    FreeCell *free_list;
+    uint64_t mark_bits[GC_BITMAP_WORDS];
+    uint64_t alloc_bits[GC_BITMAP_WORDS];
+
+    size_t index_of(void *ptr) {
+        return ((char *)ptr - objects) / object_size;
+    }
+    bool test(uint64_t *bits, size_t i) {
+        return bits[i / 64] & ((uint64_t)1 << (i % 64));
+    }
+    void set(uint64_t *bits, size_t i) {
+        bits[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+    // Set bit `i` atomically. Returns false if it was already set.
+    bool test_and_set(uint64_t *bits, size_t i) {
+        uint64_t mask = (uint64_t)1 << (i % 64);
+        if (__atomic_load_n(&bits[i / 64], __ATOMIC_RELAXED) & mask) {
+            return false;
+        }
+        return !(__atomic_fetch_or(&bits[i / 64], mask, __ATOMIC_RELAXED) &
+                 mask);
+    }
+};
+
+// Layout of the objects of one type, emitted by Codegen as a constant for
+// each allocated type. Word i of an object holds a heap pointer iff bit i
+// of `pointers` is set, so only the first 64 words can hold pointers.
+struct TypeDescriptor {
+    uint64_t size;
+    uint64_t pointers;
+};
+
+// Every object is preceded by a header word pointing to its descriptor.
+// Once a nursery object has been promoted, the word holds its new address
+// tagged with GC_FORWARDED instead.
+const uint64_t GC_HEADER_SIZE = sizeof(uint64_t);
+const uint64_t GC_FORWARDED = 1;
+// Larger objects are allocated in the old generation directly.
+const size_t GC_NURSERY_MAX_OBJECT = 1024;
+
+// The young generation: a thread-local run of pages that objects are bump
+// allocated from. Every page keeps a PageHeader so the card barrier can be
+// applied to any object without checking its generation first.
+//
+// Compiled code allocates inline by advancing `cursor` while it stays
+// within `limit`, the end of the current page, and calls alloc_typed
+// otherwise. Memory above `cursor` is always zeroed.
+struct Nursery {
+    char *cursor;
+    char *limit;
+    char *start;
+    char *end;
+};
+
+extern "C" thread_local Nursery otus_nursery;
+
+// Set while an incremental collection is marking. Compiled code then
+// passes every heap pointer it stores to otus_gc_shade.
+extern "C" bool otus_gc_marking;
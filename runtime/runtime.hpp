@@ -1,9 +1,50 @@
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <vector>
 #include <map>
 
+struct TypeDescriptor;
+
+// Bucket i of the pause histogram counts pauses shorter than 2^i
+// microseconds that do not fit an earlier bucket. The last bucket also
+// counts every longer pause.
+const int OTUS_GC_PAUSE_BUCKETS = 24;
+
+// Counters kept by the collector, read with otus_gc_stats.
+struct OtusGCStats {
+    // Unless OTUS_GC_STATS or OTUS_GC_TRACE is set, objects allocated in
+    // the nursery are not counted, and allocated_bytes counts the nursery
+    // space they took instead of their sizes.
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    uint64_t promoted_bytes;
+    uint64_t minor_collections;
+    uint64_t major_collections;
+    // Old generation bytes marked by the last major collection.
+    uint64_t live_bytes;
+    // Old generation bytes in use.
+    uint64_t heap_bytes;
+    // Old generation bytes backed by memory, in use or not.
+    uint64_t committed_bytes;
+    uint64_t pauses;
+    double pause_total_us;
+    double pause_max_us;
+    uint64_t pause_histogram[OTUS_GC_PAUSE_BUCKETS];
+};
+
 extern "C" {
+    // Objects from alloc hold no heap pointers; alloc_typed lays objects
+    // out as described by `type` (see gc.hpp).
     void *alloc(size_t size);
+    void *alloc_typed(const TypeDescriptor *type);
+    // Write barrier of incremental collections; see otus_gc_marking.
+    void otus_gc_shade(void *obj);
+    void otus_gc_stats(OtusGCStats *stats);
+    // Called by compiled modules with their stack maps; see stack_map.hpp.
+    void otus_gc_add_stack_map(const uint8_t *map);
+    // Whether the CPU has `feature`, one of OTUS_CPU_FEATURES (cpu.hpp).
+    // Multiversioned functions call it while the program is loaded.
+    int otus_cpu_supports(const char *feature);
     void collect();
 }
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <unordered_map>
+
+// Roots of code compiled with the statepoint backend (otus -gc statepoint).
+// Every call that may collect is a statepoint, and LLVM describes each one
+// in a stack map (version 3 of the format in LLVM's StackMaps.rst): the
+// root slots live across the call, as offsets from the stack or frame
+// pointer of the calling frame. At a collection the runtime walks the
+// frame pointer chain and looks up each return address.
+//
+// Each compiled module passes its .llvm_stackmaps section to
+// otus_gc_add_stack_map before main runs.
+
+struct StackMapLocation {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t size;
+    uint16_t reg;
+    uint16_t reserved2;
+    int32_t offset;
+};
+
+typedef enum StackMapLocationType {
+    SM_REGISTER = 1,
+    SM_DIRECT,
+    SM_INDIRECT,
+    SM_CONSTANT,
+    SM_CONSTANT_INDEX,
+} StackMapLocationType;
+
+// DWARF register numbers of the x86-64 stack and frame pointers.
+const uint16_t SM_REG_RBP = 6;
+const uint16_t SM_REG_RSP = 7;
+
+// The locations recorded for one statepoint. The first three are
+// constants: the calling convention, the flags and the number of deopt
+// locations that follow.
+struct StackMapCallSite {
+    const StackMapLocation *locations;
+    uint16_t num_locations;
+};
+
+class StackMaps {
+  private:
+    // Call sites by return address.
+    std::unordered_map<uintptr_t, StackMapCallSite> call_sites;
+
+    template <typename T> static T read(const uint8_t *p) {
+        return *(const T *)p;
+    }
+
+    static const uint8_t *align8(const uint8_t *p) {
+        return (const uint8_t *)(((uintptr_t)p + 7) & ~(uintptr_t)7);
+    }
+
+    // Whether `fp` can be a frame pointer of the current thread.
+    static bool on_stack(void **fp) {
+        static thread_local char *lo = nullptr;
+        static thread_local char *hi = nullptr;
+        if (lo == nullptr) {
+            pthread_attr_t attr;
+            void *addr;
+            size_t size;
+            pthread_getattr_np(pthread_self(), &attr);
+            pthread_attr_getstack(&attr, &addr, &size);
+            pthread_attr_destroy(&attr);
+            lo = (char *)addr;
+            hi = lo + size;
+        }
+        return (char *)fp >= lo && (char *)(fp + 2) <= hi &&
+               (uintptr_t)fp % sizeof(void *) == 0;
+    }
+
+    template <typename F>
+    static void visit_frame(const StackMapCallSite &site, char *sp, char *fp,
+                            F const &visitor) {
+        const StackMapLocation *loc = site.locations;
+        uint16_t i = 3 + loc[2].offset;
+        for (; i < site.num_locations; i++) {
+            if (loc[i].type == SM_CONSTANT ||
+                loc[i].type == SM_CONSTANT_INDEX) {
+                continue;
+            }
+            char *base = nullptr;
+            if (loc[i].type != SM_REGISTER) {
+                base = loc[i].reg == SM_REG_RSP   ? sp
+                       : loc[i].reg == SM_REG_RBP ? fp
+                                                  : nullptr;
+            }
+            if (base == nullptr) {
+                std::fprintf(stderr,
+                             "stack map: unsupported root location\n");
+                std::exit(1);
+            }
+            // A slot passed to the statepoint is recorded by address
+            // (direct), a spilled pointer by the slot holding it
+            // (indirect); either way the root is the slot.
+            visitor((void **)(base + loc[i].offset), nullptr);
+        }
+    }
+
+  public:
+    void add(const uint8_t *map) {
+        if (map[0] != 3) {
+            std::fprintf(stderr, "stack map: unsupported version %d\n",
+                         map[0]);
+            std::exit(1);
+        }
+        uint32_t num_functions = read<uint32_t>(map + 4);
+        uint32_t num_constants = read<uint32_t>(map + 8);
+        const uint8_t *functions = map + 16;
+        const uint8_t *p = functions + num_functions * 24 + num_constants * 8;
+        for (uint32_t f = 0; f < num_functions; f++) {
+            uint64_t address = read<uint64_t>(functions + f * 24);
+            uint64_t num_records = read<uint64_t>(functions + f * 24 + 16);
+            for (uint64_t r = 0; r < num_records; r++) {
+                uint32_t offset = read<uint32_t>(p + 8);
+                StackMapCallSite site;
+                site.num_locations = read<uint16_t>(p + 14);
+                site.locations = (const StackMapLocation *)(p + 16);
+                p = align8(p + 16 +
+                           site.num_locations * sizeof(StackMapLocation));
+                uint16_t num_live_outs = read<uint16_t>(p + 2);
+                p = align8(p + 4 + num_live_outs * 4);
+                call_sites[address + offset] = site;
+            }
+        }
+    }
+
+    // Calls visitor(root, nullptr) for each root slot of the compiled
+    // frames on the stack. The frames between here and the first compiled
+    // one are the runtime's and those of any extern that called into it,
+    // all of which keep frame pointers.
+    template <typename F> void visit_roots(F const &visitor) {
+        if (call_sites.empty()) {
+            return;
+        }
+#if defined(__x86_64__)
+        void **fp = (void **)__builtin_frame_address(0);
+        bool found = false;
+        while (on_stack(fp)) {
+            void **caller_fp = (void **)fp[0];
+            auto site = call_sites.find((uintptr_t)fp[1]);
+            if (site != call_sites.end()) {
+                // The caller's stack pointer at the call is just above
+                // the return address.
+                visit_frame(site->second, (char *)(fp + 2), (char *)caller_fp,
+                            visitor);
+                found = true;
+            } else if (found) {
+                // Past the outermost compiled frame.
+                break;
+            }
+            if (caller_fp <= fp) {
+                break;
+            }
+            fp = caller_fp;
+        }
+#else
+        std::fprintf(stderr, "stack maps are only supported on x86-64\n");
+        std::exit(1);
+#endif
+    }
+};
+
+// Modules add their stack maps from static constructors, which may run
+// before those of the runtime.
+static StackMaps &stack_maps() {
+    static StackMaps maps;
+    return maps;
+}
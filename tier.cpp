@@ -0,0 +1,18 @@
+#include "tier.hpp"
+#include "codegen.hpp"
+
+JITTier::JITTier(IR &ir) : ir(ir) {}
+
+NativeEntry JITTier::compile(const std::string &name) {
+    if (!jit) {
+        Codegen codegen(ir);
+        codegen.gen();
+        entries = codegen.gen_tier_entries();
+        jit.reset(new JIT());
+        jit->add_module(codegen.take_module());
+    }
+    if (entries.find(name) == entries.end()) {
+        return nullptr;
+    }
+    return (NativeEntry)jit->lookup(name + ".tier");
+}
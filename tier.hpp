@@ -0,0 +1,24 @@
+#pragma once
+
+#include "ir.hpp"
+#include "jit.hpp"
+#include "vm.hpp"
+
+#include <memory>
+#include <set>
+#include <string>
+
+// The native tier of `-tier` mode. The whole program is handed to the JIT
+// the first time a function gets hot; since the JIT compiles lazily, only
+// the hot functions and their callees are ever turned into machine code.
+class JITTier : public NativeTier {
+  private:
+    IR &ir;
+    std::unique_ptr<JIT> jit;
+    // Functions with a native entry point.
+    std::set<std::string> entries;
+
+  public:
+    JITTier(IR &ir);
+    NativeEntry compile(const std::string &name) override;
+};
@@ -1,133 +1,382 @@
 #include "vm.hpp"
+#include "bytecode.hpp"
 #include "ir.hpp"
 
-VM::VM(IR ir) : ir{ir}, flag{false} {}
-
-void VM::run_instr(IRInstr instr, VMEnv *e) {
-    if (instr.type == IR_ADD || instr.type == IR_SUB || instr.type == IR_MUL ||
-        instr.type == IR_DIV || instr.type == IR_GREATER ||
-        instr.type == IR_LESS || instr.type == IR_GREATER_EQ ||
-        instr.type == IR_LESS_EQ || instr.type == IR_EQ ||
-        instr.type == IR_NOT_EQ) {
-        Obj *rhs = stack.top();
-        stack.pop();
-        Obj *lhs = stack.top();
-        stack.pop();
-
-        if (lhs->type != OBJ_INT || rhs->type != OBJ_INT) {
-            error("object type must be integer");
-        }
-        Obj *result = new Obj(OBJ_INT);
-        if (instr.type == IR_ADD) {
-            result->number = lhs->number + rhs->number;
-        } else if (instr.type == IR_SUB) {
-            result->number = lhs->number - rhs->number;
-        } else if (instr.type == IR_MUL) {
-            result->number = lhs->number * rhs->number;
-        } else if (instr.type == IR_DIV) {
-            result->number = lhs->number / rhs->number;
-        } else if (instr.type == IR_GREATER) {
-            result->number = lhs->number > rhs->number;
-        } else if (instr.type == IR_LESS) {
-            result->number = lhs->number < rhs->number;
-        } else if (instr.type == IR_GREATER_EQ) {
-            result->number = lhs->number >= rhs->number;
-        } else if (instr.type == IR_LESS_EQ) {
-            result->number = lhs->number <= rhs->number;
-        } else if (instr.type == IR_EQ) {
-            result->number = lhs->number == rhs->number;
-        } else if (instr.type == IR_NOT_EQ) {
-            result->number = lhs->number != rhs->number;
-        } else if (instr.type == IR_MOD) {
-            result->number = lhs->number % rhs->number;
-        }
-        stack.push(result);
-    } else if (instr.type == IR_PUSH) {
-        stack.push(instr.operand);
-    } else if (instr.type == IR_STORE) {
-        if (instr.operand->type != OBJ_NAME) {
-            error("operand must be name");
-        }
-        e->set(instr.operand->name, stack.top());
-        stack.pop();
-    } else if (instr.type == IR_LOAD) {
-        if (instr.operand->type != OBJ_NAME) {
-            error("operand must be name");
-        }
-        if (e->get(instr.operand->name) == NULL) {
-            error("variable not found");
-        }
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
-        stack.push(e->get(instr.operand->name));
-    } else if (instr.type == IR_CALL) {
-        if (instr.operand->type != OBJ_NAME) {
-            error("operand must be name");
-        }
-        if (ir.func_map.find(instr.operand->name) == ir.func_map.end()) {
-            error("function not found");
-        }
+VM::VM(IR &ir) : bytecode(ir), next_collect{VM_MIN_CELLS}, tier{nullptr} {
+    link();
+}
+
+static inline bool is_true(const Value &val) {
+    if (val.type == VAL_BOOL) {
+        return val.bool_val;
+    }
+    return val.number != 0;
+}
+
+int VM::find_builtin(const std::string &name) {
+    if (name == "println") {
+        return BUILTIN_PRINTLN;
+    } else if (name == "print_int") {
+        return BUILTIN_PRINT_INT;
+    } else if (name == "print_float") {
+        return BUILTIN_PRINT_FLOAT;
+    } else if (name == "run_collect") {
+        return BUILTIN_RUN_COLLECT;
+    }
+    return -1;
+}
 
-        IRFunc func = ir.get_func(instr.operand->name);
-        VMEnv *new_env = new VMEnv(NULL);
-        int arg_size = func.args.size();
-        for (int i = 0; i < arg_size; i++) {
-            Obj *arg = stack.top();
-            stack.pop();
-            new_env->set(func.args[arg_size - i - 1], arg);
+// Bind every extern function to its builtin once, so calls never look
+// anything up by name.
+void VM::link() {
+    for (auto &func : bytecode.funcs) {
+        if (func.is_extern) {
+            func.builtin = find_builtin(func.name);
         }
-        Obj *obj = run_func(func, new_env);
-        stack.push(obj);
-    } else if (instr.type == IR_BR) {
-        Obj *else_code = stack.top();
-        stack.pop();
-        Obj *then_code = stack.top();
-        stack.pop();
-        if (then_code->type != OBJ_CODE || else_code->type != OBJ_CODE) {
-            error("object must be code");
+    }
+}
+
+// Let hot functions run as native code compiled by `native_tier`.
+void VM::set_tier(NativeTier *native_tier) { tier = native_tier; }
+
+// Compile `func` once it has become hot. Only the first attempt can fail;
+// the function then stays in the VM.
+bool VM::tier_up(BCFunc *func) {
+    if (func->tier_failed ||
+        func->calls + func->back_edges < VM_TIER_THRESHOLD) {
+        return false;
+    }
+    func->native = tier->compile(func->name);
+    func->tier_failed = func->native == nullptr;
+    return func->native != nullptr;
+}
+
+Value VM::call_native(const BCFunc *func, Value *args) {
+    native_args.resize(func->num_args);
+    for (int i = 0; i < func->num_args; i++) {
+        if (func->arg_types[i] == VAL_FLOAT) {
+            std::memcpy(&native_args[i], &args[i].float_number,
+                        sizeof(double));
+        } else if (func->arg_types[i] == VAL_BOOL) {
+            native_args[i] = args[i].bool_val;
+        } else {
+            native_args[i] = args[i].number;
         }
+    }
+    int64_t ret = func->native(native_args.data());
+    if (func->ret_type == VAL_INT) {
+        return Value::make_int((int)ret);
+    } else if (func->ret_type == VAL_BOOL) {
+        return Value::make_bool(ret != 0);
+    } else if (func->ret_type == VAL_FLOAT) {
+        double float_number;
+        std::memcpy(&float_number, &ret, sizeof(double));
+        return Value::make_float(float_number);
+    }
+    return Value();
+}
 
-        VMEnv *new_env = new VMEnv(e);
-        Obj *obj;
-        Obj *cond = stack.top();
-        stack.pop();
-        if (cond->type != OBJ_INT) {
-            error("condition must be integer");
+// The VM cannot link against native code, so the functions of
+// examples/lib.cpp are provided here.
+Value VM::run_builtin(int builtin, Value *args) {
+    switch (builtin) {
+    case BUILTIN_PRINTLN:
+        std::cout << args[0].str->str << std::endl;
+        break;
+    case BUILTIN_PRINT_INT:
+        std::cout << args[0].number << std::endl;
+        break;
+    case BUILTIN_PRINT_FLOAT:
+        std::cout << args[0].float_number << std::endl;
+        break;
+    case BUILTIN_RUN_COLLECT:
+        // There's nothing to collect.
+        break;
+    default:
+        error("unknown builtin function");
+    }
+    return Value();
+}
+
+// Mark every cell reachable from the live registers [0, top) and free the
+// rest. Registers above `top` belong to frames that have already returned.
+void VM::collect_cells(size_t top) {
+    for (size_t i = 0; i < top; i++) {
+        Value *val = &regs[i];
+        while (val->type == VAL_PTR && val->cell && !val->cell->marked) {
+            val->cell->marked = true;
+            val = &val->cell->value;
         }
-        if (cond->number) {
-            obj = run(then_code->code, new_env);
+    }
+
+    size_t live = 0;
+    for (auto cell : cells) {
+        if (cell->marked) {
+            cell->marked = false;
+            cells[live++] = cell;
         } else {
-            obj = run(else_code->code, new_env);
+            delete cell;
         }
-        stack.push(obj);
-    } else if (instr.type == IR_RET) {
-        return;
-    } else {
-        error("unknown instruction");
     }
+    cells.resize(live);
+    next_collect = std::max(VM_MIN_CELLS, live * 2);
 }
 
-Obj *VM::run(std::vector<IRInstr> code, VMEnv *e) {
-    for (auto instr : code) {
-        run_instr(instr, e);
+VMCell *VM::alloc_cell(Value init, size_t top) {
+    if (cells.size() >= next_collect) {
+        collect_cells(top);
     }
+    VMCell *cell = new VMCell;
+    cell->value = init;
+    cell->marked = false;
+    cells.push_back(cell);
+    return cell;
+}
 
-    Obj *obj = stack.top();
-    stack.pop();
-
-    return obj;
+void VM::reserve_regs(size_t size) {
+    if (regs.size() < size) {
+        regs.resize(std::max(size, regs.size() * 2));
+    }
 }
 
-Obj *VM::run_func(IRFunc func, VMEnv *e) {
-    Obj *obj = run(func.code, e);
-    return obj;
+// The interpreter loop is threaded through computed goto when the compiler
+// supports labels as values; build with -DOTUS_VM_SWITCH_DISPATCH (make
+// VM_DISPATCH=switch) to get the portable switch loop instead.
+#if defined(__GNUC__) && !defined(OTUS_VM_SWITCH_DISPATCH)
+#define OTUS_VM_COMPUTED_GOTO
+#endif
+
+#ifdef OTUS_VM_COMPUTED_GOTO
+#define VM_BEGIN_DISPATCH() VM_NEXT();
+#define VM_CASE(op) L_##op:
+#define VM_NEXT() goto *dispatch_table[(instr = pc++)->op]
+#define VM_END_DISPATCH()
+#else
+#define VM_BEGIN_DISPATCH()                                                    \
+    for (;;) {                                                                 \
+        instr = pc++;                                                          \
+        switch (instr->op) {
+#define VM_CASE(op) case op:
+#define VM_NEXT() continue
+#define VM_END_DISPATCH()                                                      \
+    default:                                                                   \
+        error("unknown instruction");                                          \
+        }                                                                      \
+        }
+#endif
+
+// R[a] = R[b] oper R[c], reading `field` and boxing the result with `make`.
+#define VM_BINARY(make, field, oper)                                           \
+    r[instr->a] = Value::make(r[instr->b].field oper r[instr->c].field)
+
+Value VM::run_func(int index) {
+    const BCFunc *func = &bytecode.funcs[index];
+    const BCInstr *pc = func->code.data();
+    size_t base = 0;
+    size_t entry_depth = frames.size();
+    reserve_regs(func->num_regs);
+    Value *r = regs.data();
+    const BCInstr *instr;
+    Value ret;
+#ifdef OTUS_VM_COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        &&L_BC_MOVE,      &&L_BC_LOADK,    &&L_BC_ADD,       &&L_BC_SUB,
+        &&L_BC_MUL,       &&L_BC_DIV,      &&L_BC_MOD,       &&L_BC_ADDF,
+        &&L_BC_SUBF,      &&L_BC_MULF,     &&L_BC_DIVF,      &&L_BC_MODF,
+        &&L_BC_EQ,        &&L_BC_NOT_EQ,   &&L_BC_GREATER,   &&L_BC_LESS,
+        &&L_BC_GREATER_EQ, &&L_BC_LESS_EQ, &&L_BC_LOGAND,    &&L_BC_LOGOR,
+        &&L_BC_BITAND,    &&L_BC_BITXOR,   &&L_BC_BITOR,     &&L_BC_NOT,
+        &&L_BC_ALLOC,     &&L_BC_LOAD_PTR, &&L_BC_STORE_PTR, &&L_BC_JMP,
+        &&L_BC_JMPF,      &&L_BC_CALL,     &&L_BC_TAILCALL,  &&L_BC_RET,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(void *) == BC_RET + 1,
+                  "dispatch_table must cover every BCOp");
+#endif
+
+    VM_BEGIN_DISPATCH()
+    VM_CASE(BC_MOVE)
+        r[instr->a] = r[instr->b];
+        VM_NEXT();
+    VM_CASE(BC_LOADK)
+        r[instr->a] = func->consts[instr->b];
+        VM_NEXT();
+    VM_CASE(BC_ADD)
+        VM_BINARY(make_int, number, +);
+        VM_NEXT();
+    VM_CASE(BC_SUB)
+        VM_BINARY(make_int, number, -);
+        VM_NEXT();
+    VM_CASE(BC_MUL)
+        VM_BINARY(make_int, number, *);
+        VM_NEXT();
+    VM_CASE(BC_DIV)
+        VM_BINARY(make_int, number, /);
+        VM_NEXT();
+    VM_CASE(BC_MOD)
+        VM_BINARY(make_int, number, %);
+        VM_NEXT();
+    VM_CASE(BC_ADDF)
+        VM_BINARY(make_float, float_number, +);
+        VM_NEXT();
+    VM_CASE(BC_SUBF)
+        VM_BINARY(make_float, float_number, -);
+        VM_NEXT();
+    VM_CASE(BC_MULF)
+        VM_BINARY(make_float, float_number, *);
+        VM_NEXT();
+    VM_CASE(BC_DIVF)
+        VM_BINARY(make_float, float_number, /);
+        VM_NEXT();
+    VM_CASE(BC_MODF)
+        r[instr->a] = Value::make_float(
+            std::fmod(r[instr->b].float_number, r[instr->c].float_number));
+        VM_NEXT();
+    VM_CASE(BC_EQ)
+        VM_BINARY(make_bool, number, ==);
+        VM_NEXT();
+    VM_CASE(BC_NOT_EQ)
+        VM_BINARY(make_bool, number, !=);
+        VM_NEXT();
+    VM_CASE(BC_GREATER)
+        VM_BINARY(make_bool, number, >);
+        VM_NEXT();
+    VM_CASE(BC_LESS)
+        VM_BINARY(make_bool, number, <);
+        VM_NEXT();
+    VM_CASE(BC_GREATER_EQ)
+        VM_BINARY(make_bool, number, >=);
+        VM_NEXT();
+    VM_CASE(BC_LESS_EQ)
+        VM_BINARY(make_bool, number, <=);
+        VM_NEXT();
+    VM_CASE(BC_LOGAND)
+        r[instr->a] =
+            Value::make_bool(is_true(r[instr->b]) && is_true(r[instr->c]));
+        VM_NEXT();
+    VM_CASE(BC_LOGOR)
+        r[instr->a] =
+            Value::make_bool(is_true(r[instr->b]) || is_true(r[instr->c]));
+        VM_NEXT();
+    VM_CASE(BC_BITAND)
+        VM_BINARY(make_int, number, &);
+        VM_NEXT();
+    VM_CASE(BC_BITXOR)
+        VM_BINARY(make_int, number, ^);
+        VM_NEXT();
+    VM_CASE(BC_BITOR)
+        VM_BINARY(make_int, number, |);
+        VM_NEXT();
+    VM_CASE(BC_NOT)
+        if (r[instr->b].type == VAL_BOOL) {
+            r[instr->a] = Value::make_bool(!r[instr->b].bool_val);
+        } else {
+            r[instr->a] = Value::make_int(-r[instr->b].number);
+        }
+        VM_NEXT();
+    VM_CASE(BC_ALLOC) {
+        Value ptr;
+        ptr.type = VAL_PTR;
+        ptr.cell = alloc_cell(func->consts[instr->b], base + func->num_regs);
+        r[instr->a] = ptr;
+        VM_NEXT();
+    }
+    VM_CASE(BC_LOAD_PTR)
+        r[instr->a] = r[instr->b].cell->value;
+        VM_NEXT();
+    VM_CASE(BC_STORE_PTR)
+        r[instr->b].cell->value = r[instr->c];
+        r[instr->a] = r[instr->c];
+        VM_NEXT();
+    VM_CASE(BC_JMP)
+        pc += instr->b;
+        VM_NEXT();
+    VM_CASE(BC_JMPF)
+        if (!is_true(r[instr->a])) {
+            pc += instr->b;
+        }
+        VM_NEXT();
+    VM_CASE(BC_CALL) {
+        BCFunc *callee = &bytecode.funcs[instr->b];
+        if (callee->is_extern) {
+            r[instr->a] = run_builtin(callee->builtin, &r[instr->a]);
+            VM_NEXT();
+        }
+        if (tier) {
+            callee->calls++;
+            if (callee->native || tier_up(callee)) {
+                r[instr->a] = call_native(callee, &r[instr->a]);
+                VM_NEXT();
+            }
+        }
+        // The arguments are already in place: the callee's frame starts at
+        // the register holding the first argument.
+        frames.push_back(VMFrame{func, pc, base});
+        base += instr->a;
+        func = callee;
+        pc = func->code.data();
+        reserve_regs(base + func->num_regs);
+        r = regs.data() + base;
+        // Clear stale values left by earlier frames so the cell collector
+        // never follows a dangling pointer.
+        for (int i = instr->c; i < func->num_regs; i++) {
+            r[i] = Value();
+        }
+        VM_NEXT();
+    }
+    VM_CASE(BC_TAILCALL) {
+        BCFunc *callee = &bytecode.funcs[instr->b];
+        if (tier) {
+            // A tail call to the running function is a loop iteration.
+            if (callee == func) {
+                callee->back_edges++;
+            } else {
+                callee->calls++;
+            }
+            if (callee->native || tier_up(callee)) {
+                ret = call_native(callee, &r[instr->a]);
+                goto vm_return;
+            }
+        }
+        // Slide the arguments down to the start of the frame and run the
+        // callee in place of the current function.
+        for (int i = 0; i < instr->c; i++) {
+            r[i] = r[instr->a + i];
+        }
+        func = callee;
+        pc = func->code.data();
+        reserve_regs(base + func->num_regs);
+        r = regs.data() + base;
+        for (int i = instr->c; i < func->num_regs; i++) {
+            r[i] = Value();
+        }
+        VM_NEXT();
+    }
+    VM_CASE(BC_RET) {
+        ret = r[instr->a];
+    vm_return:
+        if (frames.size() == entry_depth) {
+            return ret;
+        }
+        r[0] = ret;
+        VMFrame &frame = frames.back();
+        func = frame.func;
+        pc = frame.pc;
+        base = frame.base;
+        frames.pop_back();
+        r = regs.data() + base;
+        VM_NEXT();
+    }
+    VM_END_DISPATCH()
 }
 
-Obj *VM::run_main() {
-    if (ir.func_map.find("main") == ir.func_map.end()) {
+Value VM::run_main() {
+    if (bytecode.func_index.find("main") == bytecode.func_index.end()) {
         error("main function not found");
     }
 
-    VMEnv *e = new VMEnv(NULL);
-
-    return run_func(ir.get_func("main"), e);
+    return run_func(bytecode.func_index["main"]);
 }
@@ -1,42 +1,66 @@
+#pragma once
+
+#include "bytecode.hpp"
 #include "error.hpp"
 #include "ir.hpp"
 #include "parser.hpp"
 
-#include <stack>
-
-typedef struct VMEnv VMEnv;
-struct VMEnv {
-    std::map<std::string, Obj *> var_map;
-    VMEnv *parent;
-
-    VMEnv(VMEnv *parent) : parent{parent} {};
-    Obj *get(std::string name) {
-        if (var_map.find(name) != var_map.end()) {
-            return var_map[name];
-        } else {
-            if (parent == NULL) {
-                return NULL;
-            } else {
-                return parent->get(name);
-            }
-        }
-    };
-
-    void set(std::string name, Obj *obj) { var_map[name] = obj; };
+#include <vector>
+
+typedef struct VMFrame VMFrame;
+struct VMFrame {
+    const BCFunc *func;
+    const BCInstr *pc;
+    size_t base;
+};
+
+typedef enum VMBuiltin {
+    BUILTIN_PRINTLN,
+    BUILTIN_PRINT_INT,
+    BUILTIN_PRINT_FLOAT,
+    BUILTIN_RUN_COLLECT,
+} VMBuiltin;
+
+// Cells allocated before the VM first runs its collector.
+const size_t VM_MIN_CELLS = 1024;
+
+// Calls plus loop iterations (self tail calls) after which a function is
+// handed to the native tier.
+const int VM_TIER_THRESHOLD = 1000;
+
+// Compiles hot functions to native code for the VM. The implementation in
+// tier.cpp goes through Codegen and the JIT; the VM itself does not depend
+// on LLVM.
+class NativeTier {
+  public:
+    virtual ~NativeTier() {}
+    // Returns the native entry of `name`, or nullptr when the function
+    // cannot leave the VM (e.g. it takes or returns pointers).
+    virtual NativeEntry compile(const std::string &name) = 0;
 };
 
 class VM {
   private:
-    bool flag;
-    IR ir;
-    std::stack<Obj *> stack;
+    Bytecode bytecode;
+    std::vector<Value> regs;
+    std::vector<VMFrame> frames;
+    std::vector<VMCell *> cells;
+    size_t next_collect;
+    NativeTier *tier;
+    std::vector<int64_t> native_args;
+
+    void reserve_regs(size_t size);
+    void collect_cells(size_t top);
+    VMCell *alloc_cell(Value init, size_t top);
+    bool tier_up(BCFunc *func);
+    Value call_native(const BCFunc *func, Value *args);
 
   public:
-    VM(IR ir);
-    bool is_builtin_func(std::string name);
-    Obj *run_builtin(std::string name);
-    void run_instr(IRInstr instr, VMEnv *e);
-    Obj *run(std::vector<IRInstr> code, VMEnv *e);
-    Obj *run_func(IRFunc func, VMEnv *e);
-    Obj *run_main();
+    VM(IR &ir);
+    void link();
+    void set_tier(NativeTier *native_tier);
+    int find_builtin(const std::string &name);
+    Value run_builtin(int builtin, Value *args);
+    Value run_func(int index);
+    Value run_main();
 };